@@ -2,45 +2,103 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdatomic.h>
+#include <string.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "aru.h"
 #include "atomsnap.h"
 
-#define ARU_NODE_TYPE_UPDATE (0)
-#define ARU_NODE_TYPE_READ (1)
+/*
+ * With ARU_CACHELINE_LAYOUT, fields written by different parties are placed on
+ * separate cache lines to avoid false sharing, at the cost of larger objects.
+ */
+#define ARU_CACHELINE_SIZE (64)
+#ifdef ARU_CACHELINE_LAYOUT
+#define ARU_CACHELINE_ALIGNED _Alignas(ARU_CACHELINE_SIZE)
+#else
+#define ARU_CACHELINE_ALIGNED
+#endif
+
+#define ARU_NODE_TYPE_UPDATE (ARU_TYPE_UPDATE)
+#define ARU_NODE_TYPE_READ (ARU_TYPE_READ)
+
+/* Node-internal tag state between ARU_TAG_PENDING and ARU_TAG_DONE */
+#define ARU_NODE_TAG_RUNNING (2)
+
+/* The node was submitted by aru_update_keyed() */
+#define ARU_NODE_FLAG_KEYED (0x1)
+
+/* The node was submitted by aru_read_shared() */
+#define ARU_NODE_FLAG_SHARED (0x2)
+
+/* The node was submitted by aru_update_masked() */
+#define ARU_NODE_FLAG_MASKED (0x4)
+
+/* Conflict mask of a node touching every domain */
+#define ARU_CONFLICT_ALL ((uint16_t)0xFFFF)
+
+/* Maximum number of identical shared reads served by one callback */
+#define ARU_SHARED_READ_WINDOW (16)
+
+/* Slots tracking the most recent keyed updates */
+#define ARU_KEY_SLOT_BITS (6)
+#define ARU_KEY_SLOTS (1 << ARU_KEY_SLOT_BITS)
 
 /*
  * aru_node - Linked list node containing the user's function
  * @callback: user's callback function
  * @args: callback function's arguments
- * @prev: pointer to the previously inserted node
- * @next: pointer to the next inserted node
  * @user_tag_ptr: pointer fo notifying the user of the node's status
- * @tag: ARU_TAG_PENDING / ARU_TAG_DONE
- * @lock: spinlock to protect the execution of the callback function
+ * @release: user's hook for caller-provided nodes, NULL for slab nodes
+ * @key: key of a keyed update
+ * @next: pointer to the next inserted node
+ * @tag: ARU_TAG_PENDING / ARU_NODE_TAG_RUNNING / ARU_TAG_DONE
  * @type: ARU_NODE_TYPE_UPDATE / ARU_NODE_TYPE_READ
+ * @flags: ARU_NODE_FLAG_*
+ * @mask: conflict domains of a masked update
+ * @seq: position in the list, 0 until a traversal reaches the node
  *
  * The user can execute their function asynchronously through aru using the
  * aru_read() and aru_update() APIs.
  *
  * aru creates these functions as aru_node instances and manages them in a
- * doubly linked list.
+ * singly linked list. The node is either allocated from the slab or placed in
+ * the aru_node_storage given by the user via aru_update_node() and
+ * aru_read_node().
+ *
+ * Fields are grouped by writer. The first group is written only before the
+ * node is inserted, @next is written by the submitter of the next node, and
+ * @tag and @seq are written by the executing threads. @type and @flags are
+ * written only before the insertion as well, but share the hole next to @tag
+ * to keep the node within aru_node_storage.
  */
 struct aru_node {
 	void (*callback)(void *args);
 	void *args;
-	struct aru_node *prev;
-	struct aru_node *next;
 	aru_tag *user_tag_ptr;
-	_Atomic aru_tag tag;
-	pthread_spinlock_t lock;
-	int type;
+	void (*release)(struct aru_node_storage *storage);
+	uint64_t key;
+	ARU_CACHELINE_ALIGNED struct aru_node *next;
+	ARU_CACHELINE_ALIGNED _Atomic aru_tag tag;
+	uint8_t type;
+	uint8_t flags;
+	uint16_t mask;
+	_Atomic uint64_t seq;
 };
 
+_Static_assert(sizeof(struct aru_node) <= sizeof(struct aru_node_storage),
+	"aru_node_storage is too small for aru_node");
+_Static_assert(_Alignof(struct aru_node) <= _Alignof(struct aru_node_storage),
+	"aru_node_storage is not aligned enough for aru_node");
+
 /*
  * aru_tail_version - Data structure to cover the lifetime of the nodes.
  * @version: atomsnap_version to manage grace-period
@@ -48,6 +106,8 @@ struct aru_node {
  * @tail_version_next: next tail version
  * @head_node: most recent node covered the lifetime by this tail verison
  * @tail_node: oldest node covered the lifetime by this tail version
+ * @aru: aru this tail version belongs to
+ * @retired_next: link in the aru's retired list
  *
  * aru_nodes are managed as a linked list, and the tail of the list is managed
  * in an RCU-like manner. This means that when moving the tail, intermediate
@@ -68,13 +128,124 @@ struct aru_tail_version {
 	struct aru_tail_version *tail_version_next;
 	struct aru_node *head_node;
 	struct aru_node *tail_node;
+	struct aru *aru;
+	struct aru_tail_version *retired_next;
+};
+
+/*
+ * aru_key_slot - Most recent keyed update of the keys hashed to this slot
+ * @lock: serializes the insertion of keyed updates hashed to this slot
+ * @latest: most recently inserted keyed update
+ *
+ * Since the insertion happens under @lock, @latest always follows every other
+ * keyed update of this slot in the list, and is alive as long as they are.
+ */
+struct aru_key_slot {
+	_Atomic bool lock;
+	_Atomic(struct aru_node *) latest;
+};
+
+/*
+ * aru_cmd - Arguments of a command node's callback
+ * @handler: handler found in the aru's command table at submission
+ * @payload: the payload, inside the same slab object when queued
+ * @len: length of the payload
+ * @ctx: user's argument registered with the command table
+ */
+struct aru_cmd {
+	void (*handler)(const void *payload, size_t len, void *ctx);
+	const void *payload;
+	size_t len;
+	void *ctx;
+};
+
+/*
+ * aru_cmd_node - Node submitted by aru_submit_cmd() with its inline payload
+ * @node: the node, whose args point to @cmd
+ * @cmd: the command
+ * @payload: copy of the user's payload
+ *
+ * Node, command and payload are allocated at once and are adjacent in memory,
+ * so executing the command touches no other allocation.
+ */
+struct aru_cmd_node {
+	struct aru_node node;
+	struct aru_cmd cmd;
+	char payload[ARU_CMD_PAYLOAD_MAX];
+};
+
+/*
+ * aru_replica_entry - Update queued by aru_replicated_update()
+ * @replicated: object the update belongs to
+ * @update: user's update function, applied to every replica
+ * @args: update function's arguments
+ *
+ * Also used as an entry of the operation log, where @replicated is unused.
+ */
+struct aru_replica_entry {
+	struct aru_replicated *replicated;
+	void (*update)(void *replica, void *args);
+	void *args;
 };
 
+/*
+ * aru_lane - Submission lane of one NUMA node, see aru_set_lanes()
+ * @pending: nodes submitted to the lane, most recent first
+ * @lock: held by the leader splicing @pending into the list
+ *
+ * Submitters push single nodes into @pending, and the leader takes the whole
+ * stack at once, so the push side does not suffer from the ABA problem.
+ */
+struct aru_lane {
+	_Atomic(struct aru_node *) pending;
+	_Atomic bool lock;
+} __attribute__((aligned(64)));
+
 /*
  * aru - main data structure to manage functions asynchronously
  * @head: point where a new node is inserted into the linked list
+ * @inline_owner: set while a caller runs its callback without a node
  * @tail: point where the oldest node is located
  * @tail_init_flag: whether or not the tail is initialized
+ * @help_max_nodes: callbacks a submitter may execute per call, 0 if unbounded
+ * @help_max_ns: time a submitter may spend executing per call, 0 if unbounded
+ * @enqueue_only: submitters only publish nodes, drainers execute them
+ * @executor: shared executor serving this aru, NULL if none
+ * @reclaim_nodes: minimum number of nodes the tail moves by at once
+ * @fast_path: whether callers may run their callback inline on an idle aru
+ * @snapshot: latest snapshot published by @snapshot_clone, NULL if disabled
+ * @snapshot_clone: user's hook making an immutable copy of the state
+ * @snapshot_release: user's hook freeing a snapshot nobody reads anymore
+ * @snapshot_ctx: user's argument for the snapshot hooks
+ * @begin_batch: user's hook called before a thread's run of callbacks
+ * @end_batch: user's hook called after a thread's run of callbacks
+ * @batch_ctx: user's argument for the batch hooks
+ * @commands: command table used by aru_submit_cmd()
+ * @command_count: number of @commands
+ * @command_ctx: user's argument for the command handlers
+ * @lanes: per-NUMA-node submission lanes, NULL if disabled
+ * @lane_count: number of @lanes
+ * @completed_all: every node with a seq up to this value is done
+ * @completed_update: every update node with a seq up to this value is done
+ * @wait_spins: how long aru_wait() spins before parking, adapted at runtime
+ * @update_begin: number of update callbacks started
+ * @update_end: number of update callbacks finished
+ * @drainers: threads started by aru_start_drainers()
+ * @drainer_count: number of @drainers
+ * @drain_stop: tells the drainers to exit
+ * @drain_sleepers: number of drainers parked or about to park
+ * @drain_doorbell: futex word the drainers park on
+ * @executor_next: link in the executor's ready queue
+ * @executor_scheduled: whether the aru is in a ready queue or about to be
+ * @executor_refs: number of executor workers currently draining this aru
+ * @deferred_reclaim: retired node ranges are left to aru_reclaim()
+ * @retired: tail versions whose node ranges are waiting to be freed
+ * @reclaimer: thread started by aru_start_reclaimer()
+ * @reclaimer_running: whether @reclaimer has been started
+ * @reclaim_stop: tells the reclaimer to exit
+ * @reclaim_sleeping: whether the reclaimer is parked or about to park
+ * @reclaim_doorbell: futex word the reclaimer parks on
+ * @key_slots: most recent keyed updates, see aru_update_keyed()
  *
  * Data structure used when the user calls aru_read() and aru_update(). The
  * critical section of these functions is guaranteed only when aru_read() and
@@ -83,454 +254,3528 @@ struct aru_tail_version {
  *
  * Unlike the head of the linked list, the tail is managed in an RCU-like
  * manner. So the atomsnap library is used.
+ *
+ * The two watermarks only move forward, one seq at a time, and let a thread
+ * decide whether a node can be executed without looking at its predecessors.
+ *
+ * Fields are grouped by access pattern: the head written by every submitter,
+ * read-mostly fields, the watermarks written by every completion, the update
+ * counters polled by optimistic readers, and the drainer and executor
+ * bookkeeping.
  */
 struct aru {
 	struct aru_node *head;
-	struct atomsnap_gate *tail;
+	_Atomic bool inline_owner;
+	ARU_CACHELINE_ALIGNED struct atomsnap_gate *tail;
 	_Atomic int tail_init_flag;
+	uint32_t help_max_nodes;
+	int64_t help_max_ns;
+	bool enqueue_only;
+	struct aru_executor *executor;
+	uint64_t reclaim_nodes;
+	bool fast_path;
+	struct atomsnap_gate *snapshot;
+	void *(*snapshot_clone)(void *ctx);
+	void (*snapshot_release)(void *snapshot, void *ctx);
+	void *snapshot_ctx;
+	void (*begin_batch)(void *ctx);
+	void (*end_batch)(void *ctx);
+	void *batch_ctx;
+	const struct aru_command *commands;
+	uint32_t command_count;
+	void *command_ctx;
+	struct aru_lane *lanes;
+	int lane_count;
+	ARU_CACHELINE_ALIGNED _Atomic uint64_t completed_all;
+	_Atomic uint64_t completed_update;
+	_Atomic uint32_t wait_spins;
+	ARU_CACHELINE_ALIGNED _Atomic uint64_t update_begin;
+	_Atomic uint64_t update_end;
+	ARU_CACHELINE_ALIGNED pthread_t *drainers;
+	int drainer_count;
+	_Atomic bool drain_stop;
+	_Atomic int drain_sleepers;
+	_Atomic uint32_t drain_doorbell;
+	struct aru *executor_next;
+	_Atomic bool executor_scheduled;
+	_Atomic int executor_refs;
+	ARU_CACHELINE_ALIGNED bool deferred_reclaim;
+	_Atomic(struct aru_tail_version *) retired;
+	pthread_t reclaimer;
+	bool reclaimer_running;
+	_Atomic bool reclaim_stop;
+	_Atomic bool reclaim_sleeping;
+	_Atomic uint32_t reclaim_doorbell;
+	ARU_CACHELINE_ALIGNED struct aru_key_slot key_slots[ARU_KEY_SLOTS];
+};
+
+/*
+ * aru_slab_object - Hidden header placed in front of every slab object
+ * @slab: per-thread slab that owns this object
+ * @next: free list link, valid only while the object is free
+ *
+ * Objects handed out by aru_slab_alloc() always start right after this header,
+ * so the owner of an object can be found from the object pointer alone.
+ */
+struct aru_slab_object {
+	struct aru_slab *slab;
+	struct aru_slab_object *next;
+};
+
+/*
+ * aru_slab - Free lists of one object class inside a thread cache
+ * @local_free: objects freed by the owner thread, only the owner touches it
+ * @cache: thread cache containing this slab
+ * @object_size: size of the object following the aru_slab_object header
+ * @object_align: alignment of the object
+ * @remote_free: objects freed by other threads
+ *
+ * The owner thread allocates from @local_free without any atomic operation.
+ * Objects released by other threads are pushed into @remote_free, and the owner
+ * takes the whole list at once when @local_free becomes empty. Since only the
+ * owner pops, and it always pops the entire list, the push side does not suffer
+ * from the ABA problem.
+ *
+ * @remote_free is written by other threads, so it is kept away from the fields
+ * used by the owner.
+ */
+struct aru_slab {
+	struct aru_slab_object *local_free;
+	struct aru_thread_cache *cache;
+	size_t object_size;
+	size_t object_align;
+	_Alignas(64) _Atomic(struct aru_slab_object *) remote_free;
+} __attribute__((aligned(64)));
+
+#define ARU_SLAB_CLASS_NODE		(0)
+#define ARU_SLAB_CLASS_TAIL_VERSION	(1)
+#define ARU_SLAB_CLASS_SNAPSHOT		(2)
+#define ARU_SLAB_CLASS_REPLICA_OP	(3)
+#define ARU_SLAB_CLASS_CMD		(4)
+#define ARU_SLAB_CLASS_COUNT		(5)
+
+/* Number of objects carved out of a single chunk allocation */
+#define ARU_SLAB_CHUNK_OBJECTS	(64)
+
+/*
+ * aru_thread_cache - Per-thread object cache
+ * @slabs: one slab per object class
+ * @orphan_next: link used while the cache is not owned by any thread
+ *
+ * Objects allocated by a thread may be freed by any thread during tail
+ * reclamation, so a cache cannot be destroyed when its thread exits. Instead,
+ * the exiting thread puts it on the orphan list and the next new thread adopts
+ * it, together with every object still outstanding from it.
+ */
+struct aru_thread_cache {
+	struct aru_slab slabs[ARU_SLAB_CLASS_COUNT];
+	struct aru_thread_cache *orphan_next;
 };
 
-/* atomsnap_make_version() will call this function */
-struct atomsnap_version *aru_tail_version_alloc(
-	void *alloc_arg __attribute__((unused)))
+static const size_t aru_slab_object_size[ARU_SLAB_CLASS_COUNT] = {
+	[ARU_SLAB_CLASS_NODE] = sizeof(struct aru_node),
+	[ARU_SLAB_CLASS_TAIL_VERSION] = sizeof(struct aru_tail_version),
+	[ARU_SLAB_CLASS_SNAPSHOT] = sizeof(struct atomsnap_version),
+	[ARU_SLAB_CLASS_REPLICA_OP] = sizeof(struct aru_replica_entry),
+	[ARU_SLAB_CLASS_CMD] = sizeof(struct aru_cmd_node)
+};
+
+static const size_t aru_slab_object_align[ARU_SLAB_CLASS_COUNT] = {
+	[ARU_SLAB_CLASS_NODE] = _Alignof(struct aru_node),
+	[ARU_SLAB_CLASS_TAIL_VERSION] = _Alignof(struct aru_tail_version),
+	[ARU_SLAB_CLASS_SNAPSHOT] = _Alignof(struct atomsnap_version),
+	[ARU_SLAB_CLASS_REPLICA_OP] = _Alignof(struct aru_replica_entry),
+	[ARU_SLAB_CLASS_CMD] = _Alignof(struct aru_cmd_node)
+};
+
+static _Thread_local struct aru_thread_cache *aru_thread_cache_self;
+static pthread_key_t aru_thread_cache_key;
+static pthread_once_t aru_thread_cache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t aru_orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct aru_thread_cache *aru_orphan_list;
+
+/* Called at thread exit, hand the cache over to the next new thread */
+static void aru_thread_cache_exit(void *arg)
 {
-	struct aru_tail_version *tail_version 
-		= calloc(1, sizeof(struct aru_tail_version));
-	return (struct atomsnap_version *)tail_version;
+	struct aru_thread_cache *cache = (struct aru_thread_cache *)arg;
+
+	aru_thread_cache_self = NULL;
+
+	pthread_mutex_lock(&aru_orphan_lock);
+	cache->orphan_next = aru_orphan_list;
+	aru_orphan_list = cache;
+	pthread_mutex_unlock(&aru_orphan_lock);
 }
 
-/* See the comment of the struct aru_tail_version and adjust_tail() */
-#define TAIL_VERSION_RELEASE_MASK (0x8000000000000000ULL)
-void aru_tail_version_free(struct atomsnap_version *version)
+static void aru_thread_cache_key_init(void)
 {
-	struct aru_tail_version *tail_version = (struct aru_tail_version *)version;
-	struct aru_tail_version *next_tail_version = NULL;
-	struct aru_tail_version *prev_ptr 
-		= (struct aru_tail_version *)atomic_fetch_or(
-			&tail_version->tail_version_prev, TAIL_VERSION_RELEASE_MASK);
-	struct aru_node *node = NULL;	
+	pthread_key_create(&aru_thread_cache_key, aru_thread_cache_exit);
+}
 
-	/* This is not the end of linke list, so we cannot free the nodes */
-	if (prev_ptr != NULL) {
-		return;
-	}
+/*
+ * get_thread_cache - Return the calling thread's cache
+ *
+ * On the first call in a thread, adopt an orphaned cache if there is one, or
+ * create a new one. Returns NULL on failure.
+ */
+static struct aru_thread_cache *get_thread_cache(void)
+{
+	struct aru_thread_cache *cache = aru_thread_cache_self;
+	int i;
 
-	__sync_synchronize();
+	if (cache != NULL) {
+		return cache;
+	}
 
-free_tail_nodes:
+	pthread_once(&aru_thread_cache_once, aru_thread_cache_key_init);
 
-	/* This range was the last. So we can free these safely. */
-	node = tail_version->tail_node;
-	while (node != tail_version->head_node) {
-		node = node->next;
-		free(node->prev);
+	pthread_mutex_lock(&aru_orphan_lock);
+	cache = aru_orphan_list;
+	if (cache != NULL) {
+		aru_orphan_list = cache->orphan_next;
 	}
-	free(tail_version->head_node);
+	pthread_mutex_unlock(&aru_orphan_lock);
 
-	next_tail_version
-		= (struct aru_tail_version *)tail_version->tail_version_next;
-	assert(next_tail_version != NULL);
+	if (cache == NULL) {
+		cache = aligned_alloc(64, sizeof(struct aru_thread_cache));
+		if (cache == NULL) {
+			return NULL;
+		}
 
-	free(tail_version);
+		memset(cache, 0, sizeof(struct aru_thread_cache));
+		for (i = 0; i < ARU_SLAB_CLASS_COUNT; i++) {
+			cache->slabs[i].cache = cache;
+			cache->slabs[i].object_size = aru_slab_object_size[i];
+			cache->slabs[i].object_align = aru_slab_object_align[i];
+		}
+	}
 
-	prev_ptr = (struct aru_tail_version *)atomic_load(
-		&next_tail_version->tail_version_prev);
+	cache->orphan_next = NULL;
+	aru_thread_cache_self = cache;
+	pthread_setspecific(aru_thread_cache_key, cache);
 
-	if (((uint64_t)prev_ptr & TAIL_VERSION_RELEASE_MASK) != 0 ||
-		!atomic_compare_exchange_weak(&next_tail_version->tail_version_prev,
-			&prev_ptr, NULL)) {
-		tail_version = next_tail_version;
-		goto free_tail_nodes;
-	}
+	return cache;
 }
 
 /*
- * Returns pointer to an aru, or NULL on failure.
+ * refill_slab - Fill the local free list of the given slab
+ * @slab: slab of the calling thread
+ *
+ * Objects returned by other threads are preferred. If there are none, allocate
+ * a new chunk and split it into objects. Chunks are never returned to the
+ * system, because their objects migrate between caches.
+ *
+ * Each object is preceded by a slot holding its aru_slab_object header. For
+ * objects aligned beyond 16 bytes, the slot is widened to keep the alignment.
+ *
+ * Returns false if memory allocation failed.
  */
-struct aru *aru_init(void)
+static bool refill_slab(struct aru_slab *slab)
 {
-	struct atomsnap_init_context ctx = {
-		.atomsnap_alloc_impl = aru_tail_version_alloc,
-		.atomsnap_free_impl = aru_tail_version_free
-	};
-	struct aru *aru_ptr = calloc(1, sizeof(struct aru));
+	size_t align = slab->object_align > 16 ? slab->object_align : 16;
+	size_t slot = align;
+	size_t stride = slot + ((slab->object_size + align - 1) & ~(align - 1));
+	struct aru_slab_object *obj = NULL;
+	char *chunk = NULL;
+	int i;
+
+	slab->local_free = atomic_exchange(&slab->remote_free, NULL);
+	if (slab->local_free != NULL) {
+		return true;
+	}
 
-	if (aru_ptr == NULL) {
-		fprintf(stderr, "aru_init: aru allocaation failed\n");
-		return NULL;
+	chunk = aligned_alloc(64, stride * ARU_SLAB_CHUNK_OBJECTS);
+	if (chunk == NULL) {
+		return false;
 	}
 
-	aru_ptr->tail = atomsnap_init_gate(&ctx);
-	if (aru_ptr->tail == NULL) {
-		fprintf(stderr, "aru_init: atomsnap_init_gate() failed\n");
-		free(aru_ptr);
-		return NULL;
+	for (i = ARU_SLAB_CHUNK_OBJECTS - 1; i >= 0; i--) {
+		obj = (struct aru_slab_object *)(chunk + stride * i + slot) - 1;
+		obj->slab = slab;
+		obj->next = slab->local_free;
+		slab->local_free = obj;
 	}
 
-	return aru_ptr;
+	return true;
 }
 
 /*
- * Destory the given aru.
+ * aru_slab_alloc - Allocate an object of the given class
+ * @class: ARU_SLAB_CLASS_*
+ *
+ * Returns pointer to an uninitialized object, or NULL on failure.
  */
-void aru_destroy(struct aru *aru)
+static void *aru_slab_alloc(int class)
 {
-	if (aru == NULL) {
-		return;
-	}
+	struct aru_thread_cache *cache = get_thread_cache();
+	struct aru_slab_object *obj = NULL;
+	struct aru_slab *slab = NULL;
 
-	atomsnap_destroy_gate(aru->tail);
+	if (cache == NULL) {
+		return NULL;
+	}
 
-	if (aru->head != NULL) {
-		free(aru->head);
+	slab = &cache->slabs[class];
+	if (slab->local_free == NULL && !refill_slab(slab)) {
+		return NULL;
 	}
 
-	free(aru);
+	obj = slab->local_free;
+	slab->local_free = obj->next;
+
+	return obj + 1;
 }
 
 /*
- * adjust_tail - Move the tail
- * @aru: pointer of the aru
- * @new_tail: the aru_node that will become the new tail
- *
- * Calling atomsnap_compare_exchange_version() in this function starts the grace
- * period for the previous tail version. The last thread to release this old
- * tail version will execute aru_tail_version_free().
+ * aru_slab_free - Return the object to the cache it was allocated from
+ * @ptr: object returned by aru_slab_alloc()
  *
- * The reference to the old tail version is released after this function
- * returns. This ensures that the deallocation for this old version will not be
- * executed until at least that point. So it is safe to link the old version
- * with the newly created version in here.
+ * If the caller owns the cache, the object goes back to the local free list.
+ * Otherwise it is pushed into the owner's remote free list.
  */
-static void adjust_tail(struct aru *aru,
-	struct aru_tail_version *prev_tail_version, struct aru_node *new_tail_node)
+static void aru_slab_free(void *ptr)
 {
-	struct aru_tail_version *new_tail_version
-		 = (struct aru_tail_version *)atomsnap_make_version(aru->tail, NULL);
+	struct aru_slab_object *obj = (struct aru_slab_object *)ptr - 1;
+	struct aru_slab *slab = obj->slab;
+	struct aru_slab_object *head = NULL;
 
-	atomic_store(&new_tail_version->tail_version_prev, prev_tail_version);
-	atomic_store(&new_tail_version->tail_version_next, NULL);
-
-	new_tail_version->head_node = NULL;
-	new_tail_version->tail_node = new_tail_node;
-
-	if (!atomsnap_compare_exchange_version(aru->tail,
-			(struct atomsnap_version *)prev_tail_version,
-			(struct atomsnap_version *)new_tail_version)) {
-		free(new_tail_version);
+	if (slab->cache == aru_thread_cache_self) {
+		obj->next = slab->local_free;
+		slab->local_free = obj;
 		return;
 	}
 
-	__sync_synchronize();
-	atomic_store(&prev_tail_version->tail_version_next, new_tail_version);
-	prev_tail_version->head_node = new_tail_node->prev;
+	head = atomic_load(&slab->remote_free);
+	do {
+		obj->next = head;
+	} while (!atomic_compare_exchange_weak(&slab->remote_free, &head, obj));
 }
 
-#define TRY_NEXT (0)
-#define BREAK (1)
 /*
- * execute_node - try to execute the callback function of the node
- * @node: pointer of the node
- * @tail_node: the node corresponding to the tail version
- *
- * If this node contains an update function that requires exclusive execution,
- * it checks whether the all previous nodes have completed or not. If it
- * represents a read function, it checks whether the all previous update
- * functions have completed or not.
- *
- * If we can execute this node's callback function, attempt to acquire the
- * spinlock for the node. If successful, execute it. If we failed, return a
- * value indicating to proceed to the next node.
- *
- * Returns TRY_NEXT or BREAK.
+ * free_node - Give the node back to where it came from
+ * @node: node that no thread can reach anymore
  */
-static int execute_node(struct aru_node *node, struct aru_node *tail_node)
+static void free_node(struct aru_node *node)
 {
-	struct aru_node *prev_node = NULL;
-
-	if (node != tail_node) {
-		while (node->prev == NULL) {
-			__asm__ __volatile__("pause");
-		}
-		prev_node = node->prev;
+	if (node->release != NULL) {
+		node->release((struct aru_node_storage *)node);
+	} else {
+		aru_slab_free(node);
+	}
+}
 
-		if (node->type == ARU_NODE_TYPE_UPDATE) {
-			while (prev_node != NULL && prev_node != tail_node) {
-				if (atomic_load(&prev_node->tag) != ARU_TAG_DONE) {
-					return BREAK;
-				}
+/* Bounds of the adaptive spin in aru_wait(), in pause instructions */
+#define ARU_WAIT_SPIN_MIN	(64)
+#define ARU_WAIT_SPIN_INIT	(1024)
+#define ARU_WAIT_SPIN_MAX	(65536)
 
-				while (prev_node->prev == NULL) {
-					__asm__ __volatile__("pause");
-				}
-				prev_node = prev_node->prev;
-			}
+/* A parked aru_wait() wakes up at least this often to help, in nanoseconds */
+#define ARU_WAIT_PARK_NS	(1000000LL)
 
-			if (atomic_load(&tail_node->tag) != ARU_TAG_DONE) {
-				return BREAK;
-			}
-		} else {
-			while (prev_node != NULL && prev_node != tail_node) {
-				if (prev_node->type == ARU_NODE_TYPE_UPDATE &&
-						atomic_load(&prev_node->tag) != ARU_TAG_DONE) {
-					return BREAK;
-				}
+/* An idle drainer re-checks the aru at least this often, in nanoseconds */
+#define ARU_DRAIN_PARK_NS	(100000000LL)
 
-				while (prev_node->prev == NULL) {
-					__asm__ __volatile__("pause");
-				}
-				prev_node = prev_node->prev;
-			}
+static void futex_wait(uint32_t *uaddr, uint32_t val, int64_t timeout_ns)
+{
+	struct timespec ts = {
+		.tv_sec = timeout_ns / 1000000000LL,
+		.tv_nsec = timeout_ns % 1000000000LL
+	};
 
-			if (tail_node->type == ARU_NODE_TYPE_UPDATE &&
-					atomic_load(&tail_node->tag) != ARU_TAG_DONE) {
-				return BREAK;
-			}
-		}
-	}
+	syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
 
-	if (pthread_spin_trylock(&node->lock) == 0) {
-		node->callback(node->args);
-		atomic_store(&node->tag, ARU_TAG_DONE);
+static void futex_wake(uint32_t *uaddr, int count)
+{
+	syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
 
-		if (node->user_tag_ptr != NULL) {
-			atomic_store(node->user_tag_ptr, ARU_TAG_DONE);
-		}
-	}
+static int64_t clock_now_ns(void)
+{
+	struct timespec ts;
 
-	return TRY_NEXT;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
+/* Where the kernel lists the online NUMA nodes, like "0-1" or "0,2-3" */
+#define ARU_NUMA_ONLINE_PATH "/sys/devices/system/node/online"
+
+/* Online NUMA nodes beyond this many are not used */
+#define ARU_NUMA_MAX_NODES (64)
+
+/* Ids of the online NUMA nodes, loaded once by load_numa_nodes() */
+static int aru_numa_nodes[ARU_NUMA_MAX_NODES];
+static int aru_numa_count = 1;
+static pthread_once_t aru_numa_once = PTHREAD_ONCE_INIT;
+
 /*
- * execute_nodes_and_adjust_tail - try to execute nodes and adjust tail
- * @aru: pointer of the aru
- * @tail_version: the tail version referenced by this function
- * @inserted_node: pointer to the node inserted by the caller
- *
- * Traverse from the tail to the most recent node, attempting to execute
- * callback functions. Since node insertion is lock-free, the next pointer may
- * temporarily appear as null.
- *
- * If the node was inserted before the current execution flow's inserted node,
- * its next pointer will be set soon, so wait for it. Otherwise, if the node is
- * likely the most recent one, terminate immediately.
+ * load_numa_nodes - Read the ids of the online NUMA nodes from sysfs
  *
- * We ensure that aru-head never becomes null. So when traversing nodes, track
- * the previous node and use it to update the tail.
+ * Node ids may have holes, like "0,2", so replicas and lanes are indexed by
+ * the position of their node in this list rather than by the node id. If the
+ * list cannot be read, node 0 is assumed to be the only one.
  */
-static void execute_nodes_and_adjust_tail(struct aru *aru, 
-	struct aru_tail_version *tail_version, struct aru_node *inserted_node)
+static void load_numa_nodes(void)
 {
-	struct aru_node *node = tail_version->tail_node;
-	struct aru_node *prev_node = node;
-	bool after_inserted_node = false;
-
-	while (node != NULL) {
-		if (atomic_load(&node->tag) == ARU_TAG_PENDING &&
-				execute_node(node, tail_version->tail_node) == BREAK) {
-			break;
-		}
-
-		/*
-		 * From this point, it is not guaranteed that the node's next
-		 * pointer will be set soon.
-		 */
-		if (node == inserted_node) {
-			after_inserted_node = true;
-		}
+	FILE *fp = fopen(ARU_NUMA_ONLINE_PATH, "r");
+	char buf[256], *p = buf, *end = NULL;
+	long first, last;
+	int count = 0;
 
-		if (after_inserted_node) {
-			prev_node = node;
-			node = node->next;
-		} else {
-			/*
-			 * If the node was inserted before the inserted_node, its next
-			 * pointer will be set soon.
-			 */
-			while (node->next == NULL) {
-				__asm__ __volatile__("pause");
-			}
+	if (fp == NULL) {
+		return;
+	}
 
-			prev_node = node;
-			node = node->next;
-		}
+	if (fgets(buf, sizeof(buf), fp) == NULL) {
+		fclose(fp);
+		return;
 	}
+	fclose(fp);
 
-	if (prev_node != tail_version->tail_node) {
-		while (prev_node->prev == NULL) {
-			__asm__ __volatile__("pause");
+	while (count < ARU_NUMA_MAX_NODES) {
+		first = strtol(p, &end, 10);
+		if (end == p) {
+			break;
 		}
-		node = prev_node->prev;
+		last = first;
+		p = end;
 
-		while (node != tail_version->tail_node) {
-			if (atomic_load(&node->tag) != ARU_TAG_DONE) {
-				return;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1) {
+				break;
 			}
+			p = end;
+		}
 
-			while (node->prev == NULL) {
-				__asm__ __volatile__("pause");
-			}
-			node = node->prev;
+		for (; first <= last && count < ARU_NUMA_MAX_NODES; first++) {
+			aru_numa_nodes[count++] = (int)first;
 		}
-		if (atomic_load(&node->tag) != ARU_TAG_DONE) {
-			return;
+
+		if (*p != ',') {
+			break;
 		}
+		p++;
+	}
 
-		adjust_tail(aru, tail_version, prev_node);
+	if (count > 0) {
+		aru_numa_count = count;
 	}
 }
 
 /*
- * insert_node_and_execute - Insert the node and execute functions from tail
- * @aru: pointer of the aru
- * @node: pointer of the aru_node to insert
- *
- * Atomically insert the given node at the head of aru's linked list and execute
- * as many node functions as possible starating from the tail.
+ * numa_node_count - Number of online NUMA nodes, 1 if unknown
  */
-static void insert_node_and_execute(struct aru *aru, struct aru_node *node)
+static int numa_node_count(void)
 {
-	struct aru_node *prev_head = NULL;
-	struct aru_tail_version *tail = NULL;
+	pthread_once(&aru_numa_once, load_numa_nodes);
 
-	node->next = NULL;
-	prev_head = atomic_exchange(&aru->head, node);
+	return aru_numa_count;
+}
 
-	/*
-	 * prev_head is NULL only for the first node inserted after aru is
+/*
+ * numa_node_id - Id of the online NUMA node at the given position
+ * @index: position, wrapped around the number of online nodes
+ */
+static int numa_node_id(int index)
+{
+	pthread_once(&aru_numa_once, load_numa_nodes);
+
+	return aru_numa_nodes[index % aru_numa_count];
+}
+
+/*
+ * current_numa_index - Position of the calling thread's NUMA node
+ *
+ * Returns the position of the node among the online nodes, 0 if unknown.
+ */
+static int current_numa_index(void)
+{
+	unsigned int cpu = 0, node = 0;
+	int i;
+
+	pthread_once(&aru_numa_once, load_numa_nodes);
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+		return 0;
+	}
+
+	for (i = 0; i < aru_numa_count; i++) {
+		if (aru_numa_nodes[i] == (int)node) {
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * complete_user_tag - Notify the user that the node is done
+ * @tag: user's tag, may be NULL
+ * @value: ARU_TAG_DONE, possibly with ARU_TAG_SKIPPED
+ *
+ * If a thread parked in aru_wait() marked the tag as ARU_TAG_WAITING, wake it
+ * up. Otherwise completing the tag costs no system call.
+ */
+static void complete_user_tag(aru_tag *tag, aru_tag value)
+{
+	if (tag != NULL && atomic_exchange(tag, value) == ARU_TAG_WAITING) {
+		futex_wake(tag, INT_MAX);
+	}
+}
+
+/* atomsnap_make_version() will call this function, @alloc_arg is the aru */
+struct atomsnap_version *aru_tail_version_alloc(void *alloc_arg)
+{
+	struct aru_tail_version *tail_version
+		= aru_slab_alloc(ARU_SLAB_CLASS_TAIL_VERSION);
+
+	if (tail_version != NULL) {
+		memset(tail_version, 0, sizeof(struct aru_tail_version));
+		tail_version->aru = (struct aru *)alloc_arg;
+	}
+
+	return (struct atomsnap_version *)tail_version;
+}
+
+/*
+ * reclaim_tail_version - Free a retired tail version and its node range
+ * @tail_version: tail version no other thread can reach anymore
+ *
+ * Returns the number of freed nodes.
+ */
+static size_t reclaim_tail_version(struct aru_tail_version *tail_version)
+{
+	struct aru_node *node = tail_version->tail_node, *next_node = NULL;
+	size_t count = 1;
+
+	while (node != tail_version->head_node) {
+		next_node = node->next;
+		free_node(node);
+		node = next_node;
+		count++;
+	}
+	free_node(tail_version->head_node);
+
+	aru_slab_free(tail_version);
+
+	return count;
+}
+
+/*
+ * retire_tail_version - Hand a node range over to aru_reclaim()
+ * @aru: pointer of the aru
+ * @tail_version: tail version no other thread can reach anymore
+ *
+ * Only aru_reclaim() pops, and it always takes the entire list, so the push
+ * does not suffer from the ABA problem.
+ */
+static void retire_tail_version(struct aru *aru,
+	struct aru_tail_version *tail_version)
+{
+	struct aru_tail_version *old = atomic_load(&aru->retired);
+
+	do {
+		tail_version->retired_next = old;
+	} while (!atomic_compare_exchange_weak(&aru->retired, &old, tail_version));
+
+	/* A non-empty list has already been seen by the reclaimer */
+	if (old == NULL && atomic_load(&aru->reclaim_sleeping)) {
+		atomic_fetch_add(&aru->reclaim_doorbell, 1);
+		futex_wake((uint32_t *)&aru->reclaim_doorbell, 1);
+	}
+}
+
+/* See the comment of the struct aru_tail_version and adjust_tail() */
+#define TAIL_VERSION_RELEASE_MASK (0x8000000000000000ULL)
+void aru_tail_version_free(struct atomsnap_version *version)
+{
+	struct aru_tail_version *tail_version = (struct aru_tail_version *)version;
+	struct aru_tail_version *next_tail_version = NULL;
+	struct aru_tail_version *prev_ptr 
+		= (struct aru_tail_version *)atomic_fetch_or(
+			&tail_version->tail_version_prev, TAIL_VERSION_RELEASE_MASK);
+	struct aru *aru = tail_version->aru;
+
+	/* This is not the end of linke list, so we cannot free the nodes */
+	if (prev_ptr != NULL) {
+		return;
+	}
+
+	__sync_synchronize();
+
+free_tail_nodes:
+
+	next_tail_version
+		= (struct aru_tail_version *)tail_version->tail_version_next;
+	assert(next_tail_version != NULL);
+
+	/* This range was the last. So we can free these safely. */
+	if (aru->deferred_reclaim) {
+		retire_tail_version(aru, tail_version);
+	} else {
+		reclaim_tail_version(tail_version);
+	}
+
+	prev_ptr = (struct aru_tail_version *)atomic_load(
+		&next_tail_version->tail_version_prev);
+
+	if (((uint64_t)prev_ptr & TAIL_VERSION_RELEASE_MASK) != 0 ||
+		!atomic_compare_exchange_weak(&next_tail_version->tail_version_prev,
+			&prev_ptr, NULL)) {
+		tail_version = next_tail_version;
+		goto free_tail_nodes;
+	}
+}
+
+/* atomsnap_make_version() will call this function, @alloc_arg is the aru */
+static struct atomsnap_version *aru_snapshot_version_alloc(void *alloc_arg)
+{
+	struct atomsnap_version *version
+		= aru_slab_alloc(ARU_SLAB_CLASS_SNAPSHOT);
+
+	if (version != NULL) {
+		version->object = NULL;
+		version->free_context = alloc_arg;
+	}
+
+	return version;
+}
+
+/* The last reader of a replaced snapshot will call this function */
+static void aru_snapshot_version_free(struct atomsnap_version *version)
+{
+	struct aru *aru = (struct aru *)version->free_context;
+
+	aru->snapshot_release(version->object, aru->snapshot_ctx);
+	aru_slab_free(version);
+}
+
+/*
+ * publish_snapshot - Clone the state and make it the latest snapshot
+ * @aru: pointer of the aru
+ *
+ * The caller must be executing with exclusivity, right after an update.
+ */
+static void publish_snapshot(struct aru *aru)
+{
+	struct atomsnap_version *version
+		= atomsnap_make_version(aru->snapshot, aru);
+
+	if (version == NULL) {
+		fprintf(stderr, "publish_snapshot: version allocation failed\n");
+		return;
+	}
+
+	version->object = aru->snapshot_clone(aru->snapshot_ctx);
+
+	atomsnap_exchange_version(aru->snapshot, version);
+}
+
+/*
+ * has_pending_nodes - Check whether the aru has nodes not yet done
+ * @aru: pointer of the aru
+ *
+ * A masked update may be done while a node before it is still pending, so the
+ * most recent node being done is not enough. The completed-all watermark must
+ * have reached it as well. A done node whose seq is not known yet counts as
+ * pending, the traversal that completed it will assign it soon.
+ */
+static bool has_pending_nodes(struct aru *aru)
+{
+	struct aru_tail_version *tail = NULL;
+	struct aru_node *head = NULL;
+	bool pending = false;
+	uint64_t seq;
+
+	/* The tail version keeps the head node alive while we look at it */
+	tail = (struct aru_tail_version *)atomsnap_acquire_version(aru->tail);
+	if (tail == NULL) {
+		return false;
+	}
+
+	head = atomic_load(&aru->head);
+	if (head != NULL) {
+		seq = atomic_load(&head->seq);
+		pending = (atomic_load(&head->tag) != ARU_TAG_DONE || seq == 0 ||
+			atomic_load(&aru->completed_all) < seq);
+	}
+
+	atomsnap_release_version((struct atomsnap_version *)tail);
+
+	return pending;
+}
+
+/*
+ * aru_executor_worker - Worker thread of an aru_executor and its ready queue
+ * @thread: the worker thread
+ * @executor: executor this worker belongs to
+ * @lock: protects the ready queue
+ * @queue_head: oldest aru in the ready queue
+ * @queue_tail: most recent aru in the ready queue
+ *
+ * Each worker owns one ready queue. Submitters spread arus over the queues,
+ * and a worker whose queue is empty steals from the others.
+ *
+ * The queue is only modified under @lock. @queue_head is atomic so that
+ * thieves can skip an empty queue without taking the lock.
+ */
+struct aru_executor_worker {
+	pthread_t thread;
+	struct aru_executor *executor;
+	pthread_mutex_t lock;
+	_Atomic(struct aru *) queue_head;
+	struct aru *queue_tail;
+} __attribute__((aligned(64)));
+
+/*
+ * aru_executor - Thread pool executing the nodes of many arus
+ * @workers: worker threads with their ready queues
+ * @worker_count: number of @workers
+ * @stop: tells the workers to exit
+ * @queued: number of arus in all ready queues
+ * @sleepers: number of workers parked or about to park
+ * @doorbell: futex word the workers park on
+ *
+ * An aru with pending nodes is put in a ready queue once, no matter how many
+ * nodes are submitted to it in the meantime. A worker takes it out and drains
+ * it with aru_sync() semantics.
+ */
+struct aru_executor {
+	struct aru_executor_worker *workers;
+	int worker_count;
+	_Atomic bool stop;
+	_Atomic int queued;
+	_Atomic int sleepers;
+	_Atomic uint32_t doorbell;
+};
+
+/* Queue index hint of the submitting thread */
+static _Thread_local unsigned int aru_executor_hint;
+
+/*
+ * schedule_aru - Put the aru in a ready queue unless it is already there
+ * @executor: executor serving the aru
+ * @aru: pointer of the aru
+ */
+static void schedule_aru(struct aru_executor *executor, struct aru *aru)
+{
+	struct aru_executor_worker *worker = NULL;
+
+	if (atomic_exchange(&aru->executor_scheduled, true)) {
+		return;
+	}
+
+	worker = &executor->workers[aru_executor_hint++ % executor->worker_count];
+
+	pthread_mutex_lock(&worker->lock);
+	aru->executor_next = NULL;
+	if (worker->queue_tail == NULL) {
+		atomic_store(&worker->queue_head, aru);
+	} else {
+		worker->queue_tail->executor_next = aru;
+	}
+	worker->queue_tail = aru;
+	pthread_mutex_unlock(&worker->lock);
+
+	atomic_fetch_add(&executor->queued, 1);
+
+	if (atomic_load(&executor->sleepers) > 0) {
+		atomic_fetch_add(&executor->doorbell, 1);
+		futex_wake((uint32_t *)&executor->doorbell, 1);
+	}
+}
+
+/*
+ * pop_ready_aru - Take an aru out of the worker's ready queue
+ * @worker: queue owner
+ * @steal: if true, give up instead of waiting when the queue is locked
+ *
+ * Returns the aru, or NULL if there is none.
+ */
+static struct aru *pop_ready_aru(struct aru_executor_worker *worker, bool steal)
+{
+	struct aru *aru = NULL;
+
+	if (steal) {
+		if (atomic_load_explicit(&worker->queue_head,
+					memory_order_relaxed) == NULL ||
+				pthread_mutex_trylock(&worker->lock) != 0) {
+			return NULL;
+		}
+	} else {
+		pthread_mutex_lock(&worker->lock);
+	}
+
+	aru = atomic_load(&worker->queue_head);
+	if (aru != NULL) {
+		atomic_store(&worker->queue_head, aru->executor_next);
+		if (aru->executor_next == NULL) {
+			worker->queue_tail = NULL;
+		}
+		atomic_fetch_sub(&worker->executor->queued, 1);
+	}
+
+	pthread_mutex_unlock(&worker->lock);
+
+	return aru;
+}
+
+/*
+ * executor_worker_main - Main loop of an executor worker
+ * @arg: pointer of the aru_executor_worker
+ *
+ * Take an aru from the own queue, or steal one from another worker, and drain
+ * it. The scheduled flag is cleared before draining, so a node submitted while
+ * draining schedules the aru again instead of being missed.
+ */
+static void *executor_worker_main(void *arg)
+{
+	struct aru_executor_worker *worker = (struct aru_executor_worker *)arg;
+	struct aru_executor *executor = worker->executor;
+	int index = worker - executor->workers, i;
+	struct aru *aru = NULL;
+	uint32_t bell;
+
+	while (!atomic_load(&executor->stop)) {
+		aru = pop_ready_aru(worker, false);
+
+		for (i = 1; aru == NULL && i < executor->worker_count; i++) {
+			aru = pop_ready_aru(
+				&executor->workers[(index + i) % executor->worker_count], true);
+		}
+
+		if (aru != NULL) {
+			atomic_fetch_add(&aru->executor_refs, 1);
+			atomic_exchange(&aru->executor_scheduled, false);
+
+			aru_sync(aru);
+
+			atomic_fetch_sub(&aru->executor_refs, 1);
+			continue;
+		}
+
+		atomic_fetch_add(&executor->sleepers, 1);
+		bell = atomic_load(&executor->doorbell);
+
+		if (atomic_load(&executor->queued) == 0 &&
+				!atomic_load(&executor->stop)) {
+			futex_wait((uint32_t *)&executor->doorbell, bell,
+				ARU_DRAIN_PARK_NS);
+		}
+
+		atomic_fetch_sub(&executor->sleepers, 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * notify_drainers - Let the threads executing the aru know about new nodes
+ * @aru: pointer of the aru
+ *
+ * If the aru is served by an executor, schedule it there. Otherwise wake up a
+ * parked drainer of the aru.
+ *
+ * A drainer increments drain_sleepers before checking for pending nodes, and
+ * the submitter reads it after exchanging the head. So either the drainer sees
+ * the new node, or the submitter sees the drainer and rings the doorbell.
+ */
+static void notify_drainers(struct aru *aru)
+{
+	if (aru->executor != NULL) {
+		schedule_aru(aru->executor, aru);
+		return;
+	}
+
+	if (atomic_load(&aru->drain_sleepers) > 0) {
+		atomic_fetch_add(&aru->drain_doorbell, 1);
+		futex_wake((uint32_t *)&aru->drain_doorbell, 1);
+	}
+}
+
+/*
+ * drainer_main - Main loop of a drainer thread
+ * @arg: pointer of the aru
+ *
+ * Execute nodes like aru_sync() while there is work, and park on the doorbell
+ * when the aru is idle.
+ */
+static void *drainer_main(void *arg)
+{
+	struct aru *aru = (struct aru *)arg;
+	uint32_t bell;
+
+	while (!atomic_load(&aru->drain_stop)) {
+		aru_sync(aru);
+
+		atomic_fetch_add(&aru->drain_sleepers, 1);
+		bell = atomic_load(&aru->drain_doorbell);
+
+		if (!has_pending_nodes(aru)) {
+			if (!atomic_load(&aru->drain_stop)) {
+				futex_wait((uint32_t *)&aru->drain_doorbell, bell,
+					ARU_DRAIN_PARK_NS);
+			}
+		} else {
+			__asm__ __volatile__("pause");
+		}
+
+		atomic_fetch_sub(&aru->drain_sleepers, 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * reclaimer_main - Body of the reclaimer thread
+ * @arg: pointer of the aru
+ */
+static void *reclaimer_main(void *arg)
+{
+	struct aru *aru = (struct aru *)arg;
+	uint32_t bell;
+
+	while (!atomic_load(&aru->reclaim_stop)) {
+		aru_reclaim(aru);
+
+		atomic_store(&aru->reclaim_sleeping, true);
+		bell = atomic_load(&aru->reclaim_doorbell);
+
+		if (atomic_load(&aru->retired) == NULL &&
+				!atomic_load(&aru->reclaim_stop)) {
+			futex_wait((uint32_t *)&aru->reclaim_doorbell, bell,
+				ARU_DRAIN_PARK_NS);
+		}
+
+		atomic_store(&aru->reclaim_sleeping, false);
+	}
+
+	return NULL;
+}
+
+/*
+ * stop_reclaimer - Stop and join the reclaimer thread of the aru
+ * @aru: pointer of the aru
+ */
+static void stop_reclaimer(struct aru *aru)
+{
+	if (!aru->reclaimer_running) {
+		return;
+	}
+
+	atomic_store(&aru->reclaim_stop, true);
+	atomic_fetch_add(&aru->reclaim_doorbell, 1);
+	futex_wake((uint32_t *)&aru->reclaim_doorbell, INT_MAX);
+
+	pthread_join(aru->reclaimer, NULL);
+	aru->reclaimer_running = false;
+}
+
+/*
+ * stop_drainers - Stop and join the drainer threads of the aru
+ * @aru: pointer of the aru
+ */
+static void stop_drainers(struct aru *aru)
+{
+	int i;
+
+	if (aru->drainers == NULL) {
+		return;
+	}
+
+	atomic_store(&aru->drain_stop, true);
+	atomic_fetch_add(&aru->drain_doorbell, 1);
+	futex_wake((uint32_t *)&aru->drain_doorbell, INT_MAX);
+
+	for (i = 0; i < aru->drainer_count; i++) {
+		pthread_join(aru->drainers[i], NULL);
+	}
+
+	free(aru->drainers);
+	aru->drainers = NULL;
+	aru->drainer_count = 0;
+}
+
+/*
+ * Returns pointer to an aru, or NULL on failure.
+ */
+struct aru *aru_init(void)
+{
+	struct atomsnap_init_context ctx = {
+		.atomsnap_alloc_impl = aru_tail_version_alloc,
+		.atomsnap_free_impl = aru_tail_version_free
+	};
+	struct aru *aru_ptr = aligned_alloc(_Alignof(struct aru),
+		sizeof(struct aru));
+
+	if (aru_ptr == NULL) {
+		fprintf(stderr, "aru_init: aru allocaation failed\n");
+		return NULL;
+	}
+
+	memset(aru_ptr, 0, sizeof(struct aru));
+
+	aru_ptr->tail = atomsnap_init_gate(&ctx);
+	if (aru_ptr->tail == NULL) {
+		fprintf(stderr, "aru_init: atomsnap_init_gate() failed\n");
+		free(aru_ptr);
+		return NULL;
+	}
+
+	aru_ptr->wait_spins = ARU_WAIT_SPIN_INIT;
+	aru_ptr->reclaim_nodes = 1;
+	aru_ptr->fast_path = true;
+
+	return aru_ptr;
+}
+
+/*
+ * Destory the given aru.
+ *
+ * Older node ranges have already been reclaimed by their tail versions or are
+ * waiting in the retired list, so only the nodes of the current tail version
+ * are left besides them. Release them here, including the caller-provided ones.
+ */
+void aru_destroy(struct aru *aru)
+{
+	struct aru_tail_version *tail = NULL;
+	struct aru_node *node = NULL, *next = NULL;
+
+	if (aru == NULL) {
+		return;
+	}
+
+	stop_drainers(aru);
+
+	/* Wait for the executor workers to let go of this aru */
+	while (atomic_load(&aru->executor_scheduled) ||
+			atomic_load(&aru->executor_refs) != 0) {
+		__asm__ __volatile__("pause");
+	}
+
+	stop_reclaimer(aru);
+	aru_reclaim(aru);
+
+	if (aru->head != NULL) {
+		tail = (struct aru_tail_version *)atomsnap_acquire_version(aru->tail);
+
+		node = tail->tail_node;
+		while (node != NULL) {
+			next = node->next;
+			free_node(node);
+			node = next;
+		}
+
+		aru_slab_free(tail);
+	}
+
+	atomsnap_destroy_gate(aru->tail);
+
+	free(aru->lanes);
+
+	if (aru->snapshot != NULL) {
+		atomsnap_exchange_version(aru->snapshot, NULL);
+		atomsnap_destroy_gate(aru->snapshot);
+	}
+
+	free(aru);
+}
+
+/*
+ * adjust_tail - Move the tail
+ * @aru: pointer of the aru
+ * @prev_tail_version: the tail version referenced by the caller
+ * @new_tail_node: the aru_node that will become the new tail
+ * @new_tail_prev: the aru_node right before @new_tail_node
+ *
+ * Calling atomsnap_compare_exchange_version() in this function starts the grace
+ * period for the previous tail version. The last thread to release this old
+ * tail version will execute aru_tail_version_free().
+ *
+ * The reference to the old tail version is released after this function
+ * returns. This ensures that the deallocation for this old version will not be
+ * executed until at least that point. So it is safe to link the old version
+ * with the newly created version in here.
+ */
+static void adjust_tail(struct aru *aru,
+	struct aru_tail_version *prev_tail_version, struct aru_node *new_tail_node,
+	struct aru_node *new_tail_prev)
+{
+	struct aru_tail_version *new_tail_version
+		 = (struct aru_tail_version *)atomsnap_make_version(aru->tail, aru);
+
+	atomic_store(&new_tail_version->tail_version_prev, prev_tail_version);
+	atomic_store(&new_tail_version->tail_version_next, NULL);
+
+	new_tail_version->head_node = NULL;
+	new_tail_version->tail_node = new_tail_node;
+
+	if (!atomsnap_compare_exchange_version(aru->tail,
+			(struct atomsnap_version *)prev_tail_version,
+			(struct atomsnap_version *)new_tail_version)) {
+		aru_slab_free(new_tail_version);
+		return;
+	}
+
+	__sync_synchronize();
+	atomic_store(&prev_tail_version->tail_version_next, new_tail_version);
+	prev_tail_version->head_node = new_tail_prev;
+}
+
+/*
+ * advance_watermarks - Move the watermarks over the given node if possible
+ * @aru: pointer of the aru
+ * @node: node that the caller has just visited
+ * @seq: seq of the node
+ *
+ * A watermark only moves from @seq - 1 to @seq, so it never skips a node that
+ * is not done yet. Every traversal calls this for each node it visits in list
+ * order, so a node completed out of order is covered by the next traversal
+ * passing over it.
+ *
+ * A read node does not hold back the update watermark, whatever its state.
+ *
+ * Returns whether the node is done.
+ */
+static bool advance_watermarks(struct aru *aru, struct aru_node *node,
+	uint64_t seq)
+{
+	bool done = (atomic_load(&node->tag) == ARU_TAG_DONE);
+	uint64_t mark = seq - 1;
+
+	if (done) {
+		atomic_compare_exchange_strong(&aru->completed_all, &mark, seq);
+		mark = seq - 1;
+	}
+
+	if (done || node->type == ARU_NODE_TYPE_READ) {
+		atomic_compare_exchange_strong(&aru->completed_update, &mark, seq);
+	}
+
+	return done;
+}
+
+/*
+ * key_slot_of - Find the slot tracking the given key
+ * @aru: pointer of the aru
+ * @key: key of a keyed update
+ */
+static inline struct aru_key_slot *key_slot_of(struct aru *aru, uint64_t key)
+{
+	return &aru->key_slots[(key * 0x9E3779B97F4A7C15ULL) >>
+		(64 - ARU_KEY_SLOT_BITS)];
+}
+
+/*
+ * is_superseded - Check whether a newer update with the same key is queued
+ * @aru: pointer of the aru
+ * @node: keyed update node the caller is traversing
+ *
+ * If a different key hashed to the same slot was inserted last, we cannot tell
+ * and conservatively answer false.
+ *
+ * A keyed node becomes the latest of its slot before it is linked, so @latest
+ * is @node or a newer node, and is alive as long as @node is.
+ */
+static bool is_superseded(struct aru *aru, struct aru_node *node)
+{
+	struct aru_node *latest = atomic_load(&key_slot_of(aru, node->key)->latest);
+
+	return latest != NULL && latest != node && latest->key == node->key;
+}
+
+/*
+ * run_callback - Run a node's callback, bracketing updates with the counters
+ * @aru: pointer of the aru
+ * @type: ARU_NODE_TYPE_UPDATE / ARU_NODE_TYPE_READ
+ * @callback: user's callback function
+ * @args: callback function's arguments
+ *
+ * Updates of disjoint conflict domains may run at the same time, so a single
+ * seqlock sequence is not enough. Instead, an update is in progress while the
+ * begin counter is ahead of the end counter.
+ */
+static inline void run_callback(struct aru *aru, int type,
+	void (*callback)(void *args), void *args)
+{
+	if (type != ARU_NODE_TYPE_UPDATE) {
+		callback(args);
+		return;
+	}
+
+	atomic_fetch_add(&aru->update_begin, 1);
+	atomic_thread_fence(memory_order_release);
+
+	callback(args);
+
+	atomic_fetch_add_explicit(&aru->update_end, 1, memory_order_release);
+}
+
+/* User tags a traversal holds back at most until its batch has ended */
+#define ARU_BATCH_TAGS (32)
+
+/*
+ * aru_done_tag - User tag to complete once the batch has ended
+ * @tag: user's tag
+ * @value: ARU_TAG_DONE, possibly with ARU_TAG_SKIPPED
+ */
+struct aru_done_tag {
+	aru_tag *tag;
+	aru_tag value;
+};
+
+/*
+ * aru_traversal - State of one execute_nodes_and_adjust_tail() call
+ * @start: node the traversal started from, kept alive by its tail version
+ * @owner: whether the caller holds the inline owner flag of the aru
+ * @batch: whether the traversal has begun a batch
+ * @pending_read: whether a read before the current node was not done when the
+ *                traversal passed it
+ * @pending_mask: conflict domains of the updates before the current node that
+ *                were not done when the traversal passed them
+ * @completed: whether the traversal has completed a node since it last looked
+ *             at the tags again, see rescan_pending()
+ * @exhausted: whether the helping budget is used up, see count_executed()
+ * @executed: number of callbacks executed so far
+ * @max_nodes: helping budget in callbacks, 0 if unbounded
+ * @max_ns: helping budget in nanoseconds, 0 if unbounded
+ * @start_ns: when the traversal started, if @max_ns is set
+ * @done_count: number of user tags in @done
+ * @done: user tags of the current batch, completed once the batch has ended
+ *
+ * A traversal starts from the tail, and every node before the tail is done. So
+ * the nodes not done seen so far are all a masked update has to wait for. They
+ * may have been done since, so the pending state only ever over-approximates.
+ */
+struct aru_traversal {
+	struct aru_node *start;
+	bool owner;
+	bool batch;
+	bool pending_read;
+	uint16_t pending_mask;
+	bool completed;
+	bool exhausted;
+	uint32_t executed;
+	uint32_t max_nodes;
+	int64_t max_ns;
+	int64_t start_ns;
+	uint32_t done_count;
+	struct aru_done_tag done[ARU_BATCH_TAGS];
+};
+
+/*
+ * count_executed - Charge an executed callback to the traversal's budget
+ * @traversal: state of the caller's traversal
+ *
+ * Called right after the callback, so the node's executor knows whether the
+ * traversal will stop in front of the next pending node.
+ */
+static inline void count_executed(struct aru_traversal *traversal)
+{
+	traversal->executed++;
+	traversal->exhausted = (traversal->max_nodes != 0 &&
+			traversal->executed >= traversal->max_nodes) ||
+		(traversal->max_ns != 0 &&
+			clock_now_ns() - traversal->start_ns >= traversal->max_ns);
+}
+
+/*
+ * finish_batch - End the traversal's batch and complete its user tags
+ * @aru: pointer of the aru
+ * @traversal: state of the caller's traversal
+ *
+ * The user tags are completed after the end hook, so a thread waiting on one
+ * of them sees the work of the hook, like a flushed log, done as well.
+ */
+static void finish_batch(struct aru *aru, struct aru_traversal *traversal)
+{
+	uint32_t i;
+
+	if (traversal->batch && aru->end_batch != NULL) {
+		aru->end_batch(aru->batch_ctx);
+	}
+	traversal->batch = false;
+
+	for (i = 0; i < traversal->done_count; i++) {
+		complete_user_tag(traversal->done[i].tag, traversal->done[i].value);
+	}
+	traversal->done_count = 0;
+}
+
+/*
+ * complete_in_batch - Complete a user tag once the current batch has ended
+ * @aru: pointer of the aru
+ * @traversal: state of the caller's traversal
+ * @tag: user's tag, may be NULL
+ * @value: ARU_TAG_DONE, possibly with ARU_TAG_SKIPPED
+ *
+ * Without an end hook there is nothing to wait for. Otherwise the tag is held
+ * back, and a batch holding ARU_BATCH_TAGS tags is ended early.
+ */
+static void complete_in_batch(struct aru *aru, struct aru_traversal *traversal,
+	aru_tag *tag, aru_tag value)
+{
+	if (tag == NULL) {
+		return;
+	}
+
+	if (aru->end_batch == NULL) {
+		complete_user_tag(tag, value);
+		return;
+	}
+
+	traversal->done[traversal->done_count].tag = tag;
+	traversal->done[traversal->done_count].value = value;
+	if (++traversal->done_count == ARU_BATCH_TAGS) {
+		finish_batch(aru, traversal);
+	}
+}
+
+/*
+ * execute_shared_read - Run a shared read for itself and its duplicates
+ * @aru: pointer of the aru
+ * @node: shared read node claimed by the caller
+ * @traversal: state of the caller's traversal
+ *
+ * Look ahead over the following reads, up to the next update, and claim the
+ * pending shared reads with the same callback and arguments. With no update in
+ * between, they would observe the same state as @node, so one callback serves
+ * all of them. Only linked nodes are considered, and at most
+ * ARU_SHARED_READ_WINDOW nodes are served at once.
+ *
+ * The nodes after @node are alive as long as @node is, so the caller's tail
+ * version covers the look-ahead.
+ */
+static void execute_shared_read(struct aru *aru, struct aru_node *node,
+	struct aru_traversal *traversal)
+{
+	struct aru_node *dups[ARU_SHARED_READ_WINDOW];
+	struct aru_node *next = node->next;
+	aru_tag expected;
+	int count = 0, i;
+
+	while (next != NULL && next->type == ARU_NODE_TYPE_READ &&
+			count < ARU_SHARED_READ_WINDOW - 1) {
+		expected = ARU_TAG_PENDING;
+		if ((next->flags & ARU_NODE_FLAG_SHARED) &&
+				next->callback == node->callback && next->args == node->args &&
+				atomic_compare_exchange_strong(&next->tag, &expected,
+					ARU_NODE_TAG_RUNNING)) {
+			dups[count++] = next;
+		}
+		next = next->next;
+	}
+
+	node->callback(node->args);
+
+	atomic_store(&node->tag, ARU_TAG_DONE);
+	traversal->completed = true;
+	complete_in_batch(aru, traversal, node->user_tag_ptr, ARU_TAG_DONE);
+
+	for (i = 0; i < count; i++) {
+		atomic_store(&dups[i]->tag, ARU_TAG_DONE);
+		complete_in_batch(aru, traversal, dups[i]->user_tag_ptr, ARU_TAG_DONE);
+	}
+}
+
+/*
+ * rescan_pending - Recompute the traversal's pending state from the node tags
+ * @traversal: state of the caller's traversal
+ * @node: node the caller is traversing
+ *
+ * The thread completing a node blocking a masked update may have passed
+ * another blocking node that was still running, and vice versa. Each stores
+ * its node's tag before loading the others' here, so at least one of them sees
+ * both done and executes the masked update.
+ *
+ * Only a traversal that has completed a node since its last rescan needs one.
+ * Whatever it has seen since was seen after its own completion, and for any
+ * other traversal the thread completing the node it waits for takes over.
+ */
+static void rescan_pending(struct aru_traversal *traversal,
+	struct aru_node *node)
+{
+	struct aru_node *prev = traversal->start;
+
+	traversal->pending_read = false;
+	traversal->pending_mask = 0;
+	traversal->completed = false;
+
+	for (; prev != node; prev = prev->next) {
+		if (atomic_load(&prev->tag) == ARU_TAG_DONE) {
+			continue;
+		}
+
+		if (prev->type == ARU_NODE_TYPE_READ) {
+			traversal->pending_read = true;
+		} else if (prev->flags & ARU_NODE_FLAG_MASKED) {
+			traversal->pending_mask |= prev->mask;
+		} else {
+			traversal->pending_mask |= ARU_CONFLICT_ALL;
+		}
+	}
+}
+
+#define TRY_NEXT (0)
+#define BREAK (1)
+#define EXECUTED (2)
+/*
+ * execute_node - try to execute the callback function of the node
+ * @aru: pointer of the aru
+ * @node: pointer of the node
+ * @seq: seq of the node
+ * @traversal: state of the caller's traversal
+ *
+ * A keyed update superseded by a newer one is marked done without running,
+ * regardless of its predecessors, since it has no effect anyway.
+ *
+ * If this node contains an update function that requires exclusive execution,
+ * all previous nodes must have completed, which is the case when the
+ * completed-all watermark has reached the previous seq. If it represents a read
+ * function, only the previous update functions must have completed, which is
+ * checked against the completed-update watermark.
+ *
+ * A masked update only waits for the reads and overlapping updates before it.
+ * If the traversal's pending state says one of them is not done, look at their
+ * tags again if needed. If one is still not done, the traversal moves on to the
+ * next node instead of stopping, so later updates of other domains are not held
+ * back. But behind a pending read or a pending update of every domain nothing
+ * can run, so then the traversal stops.
+ *
+ * If we can execute this node's callback function, attempt to claim the node
+ * by moving its tag from ARU_TAG_PENDING to ARU_NODE_TAG_RUNNING. If successful,
+ * execute it, and publish a snapshot after an update if snapshots are enabled.
+ * The first callback executed by a traversal begins its batch. If we failed,
+ * return a value indicating to proceed to the next node.
+ *
+ * Returns TRY_NEXT, BREAK or EXECUTED.
+ */
+static int execute_node(struct aru *aru, struct aru_node *node, uint64_t seq,
+	struct aru_traversal *traversal)
+{
+	aru_tag expected = ARU_TAG_PENDING;
+
+	if ((node->flags & ARU_NODE_FLAG_KEYED) && is_superseded(aru, node)) {
+		if (atomic_compare_exchange_strong(&node->tag, &expected,
+				ARU_NODE_TAG_RUNNING)) {
+			atomic_store(&node->tag, ARU_TAG_DONE);
+			traversal->completed = true;
+			complete_in_batch(aru, traversal, node->user_tag_ptr,
+				ARU_TAG_DONE | ARU_TAG_SKIPPED);
+		}
+		return TRY_NEXT;
+	}
+
+	if (node->flags & ARU_NODE_FLAG_MASKED) {
+		if (traversal->completed && (traversal->pending_read ||
+				(traversal->pending_mask & node->mask) != 0)) {
+			rescan_pending(traversal, node);
+		}
+
+		if (traversal->pending_read ||
+				traversal->pending_mask == ARU_CONFLICT_ALL) {
+			return BREAK;
+		} else if ((traversal->pending_mask & node->mask) != 0) {
+			return TRY_NEXT;
+		}
+	} else if (node->type == ARU_NODE_TYPE_UPDATE) {
+		if (atomic_load(&aru->completed_all) + 1 < seq) {
+			return BREAK;
+		}
+	} else {
+		if (atomic_load(&aru->completed_update) + 1 < seq) {
+			return BREAK;
+		}
+	}
+
+	/* A caller owns the aru through the fast path, see execute_inline() */
+	if (!traversal->owner && atomic_load(&aru->inline_owner)) {
+		return BREAK;
+	}
+
+	if (atomic_compare_exchange_strong(&node->tag, &expected,
+			ARU_NODE_TAG_RUNNING)) {
+		if (!traversal->batch && aru->begin_batch != NULL) {
+			aru->begin_batch(aru->batch_ctx);
+		}
+		traversal->batch = true;
+
+		if (node->flags & ARU_NODE_FLAG_SHARED) {
+			execute_shared_read(aru, node, traversal);
+			count_executed(traversal);
+			return EXECUTED;
+		}
+
+		run_callback(aru, node->type, node->callback, node->args);
+		count_executed(traversal);
+
+		/*
+		 * The next update, if already linked, publishes for both of us. That
+		 * holds only if this traversal goes on to run it, so not when the
+		 * budget stops us or the update may be superseded and skipped. The
+		 * tag is not done yet, so we still run exclusively.
+		 */
+		if (node->type == ARU_NODE_TYPE_UPDATE && aru->snapshot != NULL &&
+				(traversal->exhausted || node->next == NULL ||
+					node->next->type != ARU_NODE_TYPE_UPDATE ||
+					(node->next->flags & ARU_NODE_FLAG_KEYED))) {
+			publish_snapshot(aru);
+		}
+
+		atomic_store(&node->tag, ARU_TAG_DONE);
+		traversal->completed = true;
+
+		complete_in_batch(aru, traversal, node->user_tag_ptr, ARU_TAG_DONE);
+
+		return EXECUTED;
+	}
+
+	return TRY_NEXT;
+}
+
+/*
+ * execute_nodes_and_adjust_tail - try to execute nodes and adjust tail
+ * @aru: pointer of the aru
+ * @tail_version: the tail version referenced by this function
+ * @inserted_node: pointer to the node inserted by the caller
+ * @bounded: whether the aru's helping budget applies to this traversal
+ * @owner: whether the caller holds the inline owner flag and may execute
+ *
+ * Traverse from the tail to the most recent node, attempting to execute
+ * callback functions. Since node insertion is lock-free, the next pointer may
+ * temporarily appear as null.
+ *
+ * If the node was inserted before the current execution flow's inserted node,
+ * its next pointer will be set soon, so wait for it. Otherwise, if the node is
+ * likely the most recent one, terminate immediately.
+ *
+ * A node reached for the first time gets its seq from the node it was reached
+ * from. Every traversal computes the same value, so this needs no coordination.
+ *
+ * A submitting thread may otherwise keep executing other threads' callbacks
+ * for as long as they arrive. If @bounded is set, stop in front of the next
+ * pending node once the aru's helping budget is used up, and leave the rest to
+ * other helpers or aru_sync().
+ *
+ * The callbacks executed by one traversal form a batch, bracketed by the aru's
+ * batch hooks if any.
+ *
+ * We ensure that aru-head never becomes null. So when traversing nodes, track
+ * the previous node and use it to update the tail.
+ */
+static void execute_nodes_and_adjust_tail(struct aru *aru, 
+	struct aru_tail_version *tail_version, struct aru_node *inserted_node,
+	bool bounded, bool owner)
+{
+	struct aru_node *node = tail_version->tail_node;
+	struct aru_node *prev_node = node, *new_tail_prev = NULL;
+	struct aru_traversal traversal;
+	bool after_inserted_node = false;
+	uint64_t seq = atomic_load(&node->seq);
+	int ret;
+
+	/* Field by field, so that the held back tags are not cleared needlessly */
+	traversal.start = node;
+	traversal.owner = owner;
+	traversal.batch = false;
+	traversal.pending_read = false;
+	traversal.pending_mask = 0;
+	traversal.completed = false;
+	traversal.exhausted = false;
+	traversal.executed = 0;
+	traversal.max_nodes = bounded ? aru->help_max_nodes : 0;
+	traversal.max_ns = bounded ? aru->help_max_ns : 0;
+	traversal.start_ns = traversal.max_ns != 0 ? clock_now_ns() : 0;
+	traversal.done_count = 0;
+
+	while (node != NULL) {
+		if (node != prev_node) {
+			seq = atomic_load_explicit(&prev_node->seq,
+				memory_order_relaxed) + 1;
+			atomic_store_explicit(&node->seq, seq, memory_order_relaxed);
+		}
+
+		if (atomic_load(&node->tag) == ARU_TAG_PENDING) {
+			if (traversal.exhausted) {
+				break;
+			}
+
+			/* Let the next node and its payload come in while we execute */
+			if (node->next != NULL) {
+				__builtin_prefetch(node->next);
+				__builtin_prefetch((char *)node->next + ARU_CACHELINE_SIZE);
+			}
+
+			ret = execute_node(aru, node, seq, &traversal);
+			if (ret == BREAK) {
+				break;
+			}
+		}
+
+		if (!advance_watermarks(aru, node, seq)) {
+			if (node->type == ARU_NODE_TYPE_READ) {
+				traversal.pending_read = true;
+			} else if (node->flags & ARU_NODE_FLAG_MASKED) {
+				traversal.pending_mask |= node->mask;
+			} else {
+				traversal.pending_mask |= ARU_CONFLICT_ALL;
+			}
+		}
+
+		/*
+		 * From this point, it is not guaranteed that the node's next
+		 * pointer will be set soon.
+		 */
+		if (node == inserted_node) {
+			after_inserted_node = true;
+		}
+
+		if (after_inserted_node) {
+			new_tail_prev = prev_node;
+			prev_node = node;
+			node = node->next;
+		} else {
+			/*
+			 * If the node was inserted before the inserted_node, its next
+			 * pointer will be set soon. But if the node is still the head,
+			 * the inserted_node has already been passed by the tail and
+			 * reclaimed, so there is nothing to wait for.
+			 */
+			while (node->next == NULL) {
+				if (atomic_load(&aru->head) == node) {
+					break;
+				}
+				__asm__ __volatile__("pause");
+			}
+
+			new_tail_prev = prev_node;
+			prev_node = node;
+			node = node->next;
+		}
+	}
+
+	finish_batch(aru, &traversal);
+
+	/*
+	 * Every node before prev_node must be done to make it the new tail, which
+	 * is exactly what the completed-all watermark tells. To amortize the cost
+	 * of a new tail version, the tail also has to move by at least
+	 * reclaim_nodes.
+	 */
+	if (prev_node != tail_version->tail_node &&
+			atomic_load(&aru->completed_all) + 1 >=
+				atomic_load(&prev_node->seq) &&
+			atomic_load(&prev_node->seq) -
+				atomic_load(&tail_version->tail_node->seq) >=
+					aru->reclaim_nodes) {
+		adjust_tail(aru, tail_version, prev_node, new_tail_prev);
+	}
+}
+
+/*
+ * insert_nodes - Insert the nodes at the head of the list
+ * @aru: pointer of the aru
+ * @first: oldest node of the chain to insert
+ * @last: most recent node of the chain to insert
+ *
+ * Atomically insert the given chain of nodes at the head of aru's linked list.
+ *
+ * The nodes between @first and @last must already be linked with each other.
+ * Since they are not visible to other threads before the exchange, the whole
+ * chain is spliced in with a single exchange on the head.
+ */
+static void insert_nodes(struct aru *aru, struct aru_node *first,
+	struct aru_node *last)
+{
+	struct aru_node *prev_head = NULL;
+	struct aru_tail_version *tail = NULL;
+
+	last->next = NULL;
+	prev_head = atomic_exchange(&aru->head, last);
+
+	/*
+	 * prev_head is NULL only for the first node inserted after aru is
 	 * initialized. After initialization, aru->head is never NULL.
 	 */
-	if (prev_head == NULL) {
-		tail = (struct aru_tail_version *)atomsnap_make_version(aru->tail,NULL);
-		
-		tail->tail_version_prev = NULL;
-		tail->tail_version_next = NULL;
+	if (prev_head == NULL) {
+		tail = (struct aru_tail_version *)atomsnap_make_version(aru->tail, aru);
+		
+		tail->tail_version_prev = NULL;
+		tail->tail_version_next = NULL;
+
+		tail->head_node = NULL;
+		tail->tail_node = first;
+
+		atomic_store(&first->seq, 1);
+
+		atomsnap_exchange_version(aru->tail, (struct atomsnap_version *)tail);
+
+		atomic_store(&aru->tail_init_flag, 1);
+	} else {
+		prev_head->next = first;
+
+		/* Initial state */
+		while (atomic_load(&aru->tail_init_flag) == 0) {
+			__asm__ __volatile__("pause");
+		}
+	}
+}
+
+static _Thread_local int aru_lane_hint = -1;
+
+/*
+ * lane_of_thread - Find the submission lane of the calling thread
+ * @aru: pointer of the aru
+ *
+ * A thread keeps the lane of the NUMA node it first submitted from, even if it
+ * migrates. Otherwise its nodes could sit in two lanes, and be spliced out of
+ * order.
+ */
+static struct aru_lane *lane_of_thread(struct aru *aru)
+{
+	if (aru_lane_hint < 0) {
+		aru_lane_hint = current_numa_index();
+	}
+
+	return &aru->lanes[aru_lane_hint % aru->lane_count];
+}
+
+/*
+ * splice_lane - Move the nodes pending in the lane into the list
+ * @aru: pointer of the aru
+ * @lane: lane whose lock the caller holds
+ *
+ * The pending stack is reversed into submission order and inserted with a
+ * single exchange on the head.
+ *
+ * Returns the most recent node spliced, or NULL if the lane was empty.
+ */
+static struct aru_node *splice_lane(struct aru *aru, struct aru_lane *lane)
+{
+	struct aru_node *last = atomic_exchange(&lane->pending, NULL);
+	struct aru_node *first = NULL, *node = last, *next = NULL;
+
+	if (last == NULL) {
+		return NULL;
+	}
+
+	while (node != NULL) {
+		next = node->next;
+		node->next = first;
+		first = node;
+		node = next;
+	}
+
+	insert_nodes(aru, first, last);
+
+	return last;
+}
+
+/*
+ * lock_lane - Spin until the lane's lock is taken
+ * @lane: the lane
+ */
+static void lock_lane(struct aru_lane *lane)
+{
+	bool expected = false;
+
+	while (!atomic_compare_exchange_weak(&lane->lock, &expected, true)) {
+		expected = false;
+		__asm__ __volatile__("pause");
+	}
+}
+
+/*
+ * lead_lane - Splice the lane as long as nodes are pending and nobody else does
+ * @aru: pointer of the aru
+ * @lane: the lane
+ *
+ * The leader looks at the lane again after unlocking, and a submitter looks at
+ * the lock after pushing. So either a node pushed while the lane was locked is
+ * seen by the old leader, or its submitter becomes the new one.
+ *
+ * Returns the most recent node spliced, or NULL if none.
+ */
+static struct aru_node *lead_lane(struct aru *aru, struct aru_lane *lane)
+{
+	struct aru_node *last = NULL, *spliced = NULL;
+	bool expected;
+
+	while (atomic_load(&lane->pending) != NULL) {
+		expected = false;
+		if (atomic_load(&lane->lock) ||
+				!atomic_compare_exchange_strong(&lane->lock, &expected, true)) {
+			break;
+		}
+
+		spliced = splice_lane(aru, lane);
+		if (spliced != NULL) {
+			last = spliced;
+		}
+
+		atomic_store(&lane->lock, false);
+	}
+
+	return last;
+}
+
+/*
+ * insert_nodes_ordered - Insert the nodes behind the caller's earlier nodes
+ * @aru: pointer of the aru
+ * @first: oldest node of the chain to insert
+ * @last: most recent node of the chain to insert
+ *
+ * With lanes, nodes submitted earlier by this thread may still be pending in
+ * its lane. Splice them first, under the lane lock, and then insert the chain
+ * directly.
+ *
+ * Returns true if nodes of the lane were spliced along with the chain. Their
+ * submitters may have returned already, so the caller must not leave them to
+ * a bounded traversal.
+ */
+static bool insert_nodes_ordered(struct aru *aru, struct aru_node *first,
+	struct aru_node *last)
+{
+	struct aru_lane *lane = NULL;
+	bool spliced = false;
+
+	if (aru->lanes == NULL) {
+		insert_nodes(aru, first, last);
+		return false;
+	}
+
+	lane = lane_of_thread(aru);
+
+	lock_lane(lane);
+	spliced = splice_lane(aru, lane) != NULL;
+	insert_nodes(aru, first, last);
+	atomic_store(&lane->lock, false);
+
+	if (lead_lane(aru, lane) != NULL) {
+		spliced = true;
+	}
+
+	return spliced;
+}
+
+/*
+ * submit_to_lane - Push the node into the lane and splice it if nobody does
+ * @aru: pointer of the aru
+ * @node: node to submit
+ *
+ * Returns the most recent node spliced by the caller, or NULL if another
+ * leader is in charge of the lane.
+ */
+static struct aru_node *submit_to_lane(struct aru *aru, struct aru_node *node)
+{
+	struct aru_lane *lane = lane_of_thread(aru);
+	struct aru_node *top = atomic_load(&lane->pending);
+
+	do {
+		node->next = top;
+	} while (!atomic_compare_exchange_weak(&lane->pending, &top, node));
+
+	return lead_lane(aru, lane);
+}
+
+/*
+ * execute_after_insert - Execute functions from tail after an insertion
+ * @aru: pointer of the aru
+ * @last: most recent node inserted by the caller
+ * @bounded: whether the aru's helping budget applies
+ *
+ * If the aru is in enqueue-only mode, only let the drainers know. The caller
+ * never executes any callback.
+ */
+static void execute_after_insert(struct aru *aru, struct aru_node *last,
+	bool bounded)
+{
+	struct aru_tail_version *tail = NULL;
+
+	if (aru->enqueue_only) {
+		notify_drainers(aru);
+		return;
+	}
+
+	tail = (struct aru_tail_version *)atomsnap_acquire_version(aru->tail);
+
+	execute_nodes_and_adjust_tail(aru, tail, last, bounded, false);
+
+	atomsnap_release_version((struct atomsnap_version *)tail);
+}
+
+/*
+ * insert_nodes_and_execute - Insert the nodes and execute functions from tail
+ * @aru: pointer of the aru
+ * @first: oldest node of the chain to insert
+ * @last: most recent node of the chain to insert
+ *
+ * Insert the given chain of nodes and execute as many node functions as
+ * possible starating from the tail.
+ *
+ * With lanes, a single node goes through the caller's lane, and only the
+ * thread that splices the lane executes. The leader of the lane executes the
+ * nodes of the others. Their submitters have returned already, so the leader
+ * ignores the helping budget. Otherwise nodes behind the budget could be left
+ * pending with nobody to execute them.
+ */
+static void insert_nodes_and_execute(struct aru *aru, struct aru_node *first,
+	struct aru_node *last)
+{
+	bool bounded = true;
+
+	if (aru->lanes != NULL && first == last) {
+		last = submit_to_lane(aru, first);
+		if (last == NULL) {
+			return;
+		}
+		bounded = false;
+	} else if (insert_nodes_ordered(aru, first, last)) {
+		bounded = false;
+	}
+
+	execute_after_insert(aru, last, bounded);
+}
+
+/*
+ * insert_keyed_node - Insert a keyed update and make it the latest of its slot
+ * @aru: pointer of the aru
+ * @node: keyed update node
+ *
+ * The slot lock keeps the order of @latest consistent with the list order, so
+ * an older update never mistakes a node inserted before it for a newer one.
+ *
+ * @latest is published before the node is linked. Otherwise a traversal
+ * reaching the node in between would find an older node of the same key there
+ * and skip the newest update.
+ *
+ * Returns true if nodes of the caller's lane were spliced along with it.
+ */
+static bool insert_keyed_node(struct aru *aru, struct aru_node *node)
+{
+	struct aru_key_slot *slot = key_slot_of(aru, node->key);
+	bool expected = false, spliced = false;
+
+	while (!atomic_compare_exchange_weak(&slot->lock, &expected, true)) {
+		expected = false;
+		__asm__ __volatile__("pause");
+	}
+
+	atomic_store(&slot->latest, node);
+	spliced = insert_nodes_ordered(aru, node, node);
+
+	atomic_store(&slot->lock, false);
+
+	return spliced;
+}
+
+/*
+ * insert_node_and_complete - Insert the node and help until it is done
+ * @aru: pointer of the aru
+ * @node: pointer of the aru_node to insert
+ * @tag: tag of the node, owned by the caller
+ *
+ * Keep traversing from the tail until @tag becomes ARU_TAG_DONE. The node may
+ * be reclaimed by other threads as soon as it is done, so only the tag is
+ * checked, never the node itself.
+ *
+ * In enqueue-only mode, the caller does not help and waits for the drainers.
+ */
+static void insert_node_and_complete(struct aru *aru, struct aru_node *node,
+	aru_tag *tag)
+{
+	struct aru_tail_version *tail = NULL;
+
+	insert_nodes_ordered(aru, node, node);
+
+	if (aru->enqueue_only) {
+		notify_drainers(aru);
+		aru_wait(aru, tag, -1);
+		return;
+	}
+
+	for (;;) {
+		tail = (struct aru_tail_version *)atomsnap_acquire_version(aru->tail);
+
+		execute_nodes_and_adjust_tail(aru, tail, node, false, false);
+
+		atomsnap_release_version((struct atomsnap_version *)tail);
+
+		if (ARU_TAG_IS_DONE(atomic_load(tag))) {
+			break;
+		}
+
+		__asm__ __volatile__("pause");
+	}
+}
+
+/*
+ * init_node - Fill the node with the user's request
+ * @node: slab node or caller-provided storage
+ * @type: ARU_NODE_TYPE_UPDATE / ARU_NODE_TYPE_READ
+ * @tag: user's tag, may be NULL
+ * @callback: user's function
+ * @args: callback function's arguments
+ * @release: hook for caller-provided storage, NULL for slab nodes
+ */
+static void init_node(struct aru_node *node, int type, aru_tag *tag,
+	void (*callback)(void *args), void *args,
+	void (*release)(struct aru_node_storage *storage))
+{
+	node->callback = callback;
+	node->args = args;
+	node->next = NULL;
+	node->seq = 0;
+	node->user_tag_ptr = tag;
+
+	node->tag = ARU_TAG_PENDING;
+	if (tag != NULL) {
+		*tag = node->tag;
+	}
+
+	node->type = type;
+	node->flags = 0;
+	node->mask = ARU_CONFLICT_ALL;
+	node->key = 0;
+	node->release = release;
+}
+
+/*
+ * execute_inline - Run the update right away if the aru is idle
+ * @aru: pointer of the aru
+ * @tag: user's tag, may be NULL
+ * @callback: user's update function
+ * @args: update function's arguments
+ *
+ * Only updates take the fast path. The owner flag is exclusive, so a read
+ * running inline would hold back every other read until it finishes, while
+ * queued reads may run concurrently.
+ *
+ * If the aru is idle, the caller takes the owner flag and runs its callback
+ * without allocating and inserting a node. The aru is idle when the most
+ * recent node is done and so is every node before it. A node completed ahead
+ * of a traversal, like a shared read, may still lack its seq. Then we cannot
+ * tell, and the aru is not treated as idle.
+ *
+ * The owner flag is set before the head is checked, and execute_node() checks
+ * the flag after the node's insertion. So either we see a node inserted
+ * concurrently and give up, or its traversal sees the flag and leaves the node
+ * alone. In the latter case nobody may be left to execute it, so if the head
+ * has moved when we clear the flag, we drain the aru ourselves. The tail
+ * version is held until then, so the head we saw cannot be freed and reused.
+ *
+ * Nodes waiting in a submission lane are not in the list yet, so with lanes the
+ * aru never looks idle to us and the fast path is not taken.
+ *
+ * Returns true if the callback has been executed, false if the caller has to
+ * take the queued path, which also executes any node we held back.
+ */
+static bool execute_inline(struct aru *aru, aru_tag *tag,
+	void (*callback)(void *args), void *args)
+{
+	struct aru_tail_version *tail = NULL;
+	struct aru_node *head = NULL;
+	bool expected = false, idle = false, moved = false;
+	uint64_t seq = 0;
+
+	if (!aru->fast_path || aru->enqueue_only || aru->lanes != NULL ||
+			atomic_load(&aru->inline_owner) ||
+			!atomic_compare_exchange_strong(&aru->inline_owner, &expected,
+				true)) {
+		return false;
+	}
+
+	tail = (struct aru_tail_version *)atomsnap_acquire_version(aru->tail);
+	head = atomic_load(&aru->head);
+
+	if (tail == NULL) {
+		idle = (head == NULL);
+	} else {
+		seq = atomic_load(&head->seq);
+		idle = (atomic_load(&head->tag) == ARU_TAG_DONE && seq != 0 &&
+			atomic_load(&aru->completed_all) >= seq);
+	}
+
+	if (idle) {
+		if (aru->begin_batch != NULL) {
+			aru->begin_batch(aru->batch_ctx);
+		}
+
+		run_callback(aru, ARU_NODE_TYPE_UPDATE, callback, args);
+
+		if (aru->snapshot != NULL) {
+			publish_snapshot(aru);
+		}
+
+		if (aru->end_batch != NULL) {
+			aru->end_batch(aru->batch_ctx);
+		}
+
+		if (tag != NULL) {
+			atomic_store(tag, ARU_TAG_DONE);
+		}
+	}
+
+	atomic_store(&aru->inline_owner, false);
+	moved = (atomic_load(&aru->head) != head);
+
+	if (tail != NULL) {
+		atomsnap_release_version((struct atomsnap_version *)tail);
+	}
+
+	if (idle && moved) {
+		aru_sync(aru);
+	}
+
+	return idle;
+}
+
+/*
+ * aru_update - Update API provided to the user
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @update: user's update function
+ * @args: update function's arguments
+ *
+ * The user expects the update logic passed to this function to be executed
+ * asynchronously, ensuring a critical section without interference from other
+ * threads.
+ *
+ * The user can pass a tag as an argument to track the update status. If the tag
+ * is NULL, no status will be provided.
+ */
+void aru_update(struct aru *aru, aru_tag *tag,
+	void (*update)(void *args), void *args)
+{
+	struct aru_node *node = NULL;
+
+	if (execute_inline(aru, tag, update, args)) {
+		return;
+	}
+
+	node = aru_slab_alloc(ARU_SLAB_CLASS_NODE);
+	if (node == NULL) {
+		fprintf(stderr, "aru_update(): aru_node allocation failed\n");
+		return;
+	}
+
+	init_node(node, ARU_NODE_TYPE_UPDATE, tag, update, args, NULL);
+
+	insert_nodes_and_execute(aru, node, node);
+}
+
+/*
+ * aru_read - Read API provided to the user
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @read: user's read function
+ * @args: read function's arguments
+ *
+ * The user expects the read logic passed to this function to be executed
+ * asynchronously. The read function will be executed after all previously
+ * requested updates have been applied. Unlike the update logic, multiple read
+ * operations can run concurrently, but update operations are not to be executed
+ * simultaneously.
+ *
+ * The user can pass a tag as an argument to track the update status. If the tag
+ * is NULL, no status will be provided.
+ */
+void aru_read(struct aru *aru, aru_tag *tag,
+	void (*read)(void *args), void *args)
+{
+	struct aru_node *node = NULL;
+
+	node = aru_slab_alloc(ARU_SLAB_CLASS_NODE);
+	if (node == NULL) {
+		fprintf(stderr, "aru_read(): aru_node allocation failed\n");
+		return;
+	}
+
+	init_node(node, ARU_NODE_TYPE_READ, tag, read, args, NULL);
+
+	insert_nodes_and_execute(aru, node, node);
+}
+
+/*
+ * aru_update_node - Update API using caller-provided node storage
+ * @aru: pointer of the aru
+ * @storage: memory for the queue node, owned by aru until @release is called
+ * @tag: status representing progress or result
+ * @update: user's update function
+ * @args: update function's arguments
+ * @release: called with @storage once aru no longer references it
+ *
+ * Same as aru_update(), but the node lives in @storage instead of being
+ * allocated. The storage must stay valid until @release is called, which
+ * happens when tail reclamation has passed the node or when the aru is
+ * destroyed. Note that this may be well after the update itself has completed.
+ */
+void aru_update_node(struct aru *aru, struct aru_node_storage *storage,
+	aru_tag *tag, void (*update)(void *args), void *args,
+	void (*release)(struct aru_node_storage *storage))
+{
+	struct aru_node *node = (struct aru_node *)storage;
+
+	assert(release != NULL);
+
+	init_node(node, ARU_NODE_TYPE_UPDATE, tag, update, args, release);
+
+	insert_nodes_and_execute(aru, node, node);
+}
+
+/*
+ * aru_read_node - Read API using caller-provided node storage
+ * @aru: pointer of the aru
+ * @storage: memory for the queue node, owned by aru until @release is called
+ * @tag: status representing progress or result
+ * @read: user's read function
+ * @args: read function's arguments
+ * @release: called with @storage once aru no longer references it
+ *
+ * Same as aru_read(), but the node lives in @storage instead of being
+ * allocated. See aru_update_node() for the lifetime of @storage.
+ */
+void aru_read_node(struct aru *aru, struct aru_node_storage *storage,
+	aru_tag *tag, void (*read)(void *args), void *args,
+	void (*release)(struct aru_node_storage *storage))
+{
+	struct aru_node *node = (struct aru_node *)storage;
+
+	assert(release != NULL);
+
+	init_node(node, ARU_NODE_TYPE_READ, tag, read, args, release);
+
+	insert_nodes_and_execute(aru, node, node);
+}
+
+/*
+ * aru_update_sync - Update API that returns after the update is applied
+ * @aru: pointer of the aru
+ * @update: user's update function
+ * @args: update function's arguments
+ *
+ * Same as aru_update(), but the calling thread keeps helping other nodes until
+ * its own update has been executed, by itself or by another thread.
+ */
+void aru_update_sync(struct aru *aru, void (*update)(void *args), void *args)
+{
+	struct aru_node *node = NULL;
+	aru_tag tag;
+
+	if (execute_inline(aru, NULL, update, args)) {
+		return;
+	}
+
+	node = aru_slab_alloc(ARU_SLAB_CLASS_NODE);
+	if (node == NULL) {
+		fprintf(stderr, "aru_update_sync(): aru_node allocation failed\n");
+		return;
+	}
+
+	init_node(node, ARU_NODE_TYPE_UPDATE, &tag, update, args, NULL);
+
+	insert_node_and_complete(aru, node, &tag);
+}
+
+/*
+ * aru_read_sync - Read API that returns after the read is executed
+ * @aru: pointer of the aru
+ * @read: user's read function
+ * @args: read function's arguments
+ *
+ * Same as aru_read(), but the calling thread keeps helping other nodes until
+ * its own read has been executed, by itself or by another thread.
+ */
+void aru_read_sync(struct aru *aru, void (*read)(void *args), void *args)
+{
+	struct aru_node *node = NULL;
+	aru_tag tag;
+
+	node = aru_slab_alloc(ARU_SLAB_CLASS_NODE);
+	if (node == NULL) {
+		fprintf(stderr, "aru_read_sync(): aru_node allocation failed\n");
+		return;
+	}
+
+	init_node(node, ARU_NODE_TYPE_READ, &tag, read, args, NULL);
+
+	insert_node_and_complete(aru, node, &tag);
+}
+
+/*
+ * aru_submit_batch - Submit several requests at once
+ * @aru: pointer of the aru
+ * @entries: requests in the order they must be applied
+ * @count: number of entries
+ *
+ * The nodes for all entries are linked privately and spliced into the list
+ * with a single exchange on the head, followed by a single traversal. The
+ * entries are ordered as if they were submitted one by one in array order.
+ *
+ * All nodes are allocated before any user tag is written, so a failed batch
+ * leaves the tags untouched.
+ *
+ * Returns true if the batch was submitted, false on allocation failure.
+ */
+bool aru_submit_batch(struct aru *aru, struct aru_batch_entry *entries,
+	size_t count)
+{
+	struct aru_node *first = NULL, *last = NULL, *node = NULL, *next = NULL;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		node = aru_slab_alloc(ARU_SLAB_CLASS_NODE);
+
+		if (node == NULL) {
+			fprintf(stderr, "aru_submit_batch(): aru_node allocation failed\n");
+
+			while (first != NULL) {
+				node = first->next;
+				aru_slab_free(first);
+				first = node;
+			}
+			return false;
+		}
+
+		node->next = NULL;
+		if (last == NULL) {
+			first = node;
+		} else {
+			last->next = node;
+		}
+		last = node;
+	}
+
+	for (i = 0, node = first; node != NULL; i++, node = next) {
+		next = node->next;
+		init_node(node, entries[i].type, entries[i].tag, entries[i].callback,
+			entries[i].args, NULL);
+		node->next = next;
+	}
+
+	if (first != NULL) {
+		insert_nodes_and_execute(aru, first, last);
+	}
+
+	return true;
+}
+
+/*
+ * aru_sync - Sync API provided to the user
+ * @aru: pointer of the aru
+ *
+ * Explicitly execute the callback function for the given aru in the current
+ * thread. For example, if the number of threads executing aru's callback
+ * functions is lower than the number of read functions, this can be used to
+ * improve read function throughput.
+ */
+void aru_sync(struct aru *aru)
+{
+	struct aru_tail_version *tail = NULL;
+
+	tail = (struct aru_tail_version *)atomsnap_acquire_version(aru->tail);
+	if (tail == NULL) {
+		return;
+	}
+
+	/*
+	 * This function does not insert a new node. Therefore, provide the tail
+	 * node to avoid unnecessary waiting during the traversal.
+	 */
+	execute_nodes_and_adjust_tail(aru, tail, tail->tail_node, false, false);
+
+	atomsnap_release_version((struct atomsnap_version *)tail);
+}
+
+/*
+ * aru_wait - Wait until the given tag becomes ARU_TAG_DONE
+ * @aru: pointer of the aru the tag was submitted to, may be NULL
+ * @tag: tag passed to aru_update(), aru_read() or one of their variants
+ * @timeout_ns: timeout in nanoseconds, negative to wait forever
+ *
+ * First help executing the aru's nodes, then spin for a while, and finally
+ * park on a futex until the thread completing the node wakes us up. The spin
+ * length adapts per aru: it grows when spinning was enough and shrinks when the
+ * thread had to park anyway.
+ *
+ * A parked thread periodically wakes up to help, so a node left behind by a
+ * helper that stopped early still makes progress.
+ *
+ * Returns true if the tag is done, false on timeout.
+ */
+bool aru_wait(struct aru *aru, aru_tag *tag, int64_t timeout_ns)
+{
+	int64_t deadline = 0, slice = 0;
+	aru_tag value = ARU_TAG_PENDING;
+	uint32_t spins = ARU_WAIT_SPIN_INIT, i;
+
+	if (ARU_TAG_IS_DONE(atomic_load(tag))) {
+		return true;
+	}
+
+	if (timeout_ns >= 0) {
+		deadline = clock_now_ns() + timeout_ns;
+	}
+
+	if (aru != NULL) {
+		if (!aru->enqueue_only) {
+			aru_sync(aru);
+		}
+		spins = atomic_load_explicit(&aru->wait_spins, memory_order_relaxed);
+	}
+
+	for (i = 0; i < spins; i++) {
+		if (ARU_TAG_IS_DONE(atomic_load(tag))) {
+			if (aru != NULL && spins < ARU_WAIT_SPIN_MAX) {
+				atomic_store_explicit(&aru->wait_spins, spins * 2,
+					memory_order_relaxed);
+			}
+			return true;
+		}
+		__asm__ __volatile__("pause");
+	}
+
+	if (aru != NULL && spins > ARU_WAIT_SPIN_MIN) {
+		atomic_store_explicit(&aru->wait_spins, spins / 2,
+			memory_order_relaxed);
+	}
+
+	for (;;) {
+		value = ARU_TAG_PENDING;
+		if (!atomic_compare_exchange_strong(tag, &value, ARU_TAG_WAITING) &&
+				ARU_TAG_IS_DONE(value)) {
+			return true;
+		}
+
+		slice = ARU_WAIT_PARK_NS;
+		if (timeout_ns >= 0) {
+			slice = deadline - clock_now_ns();
+			if (slice <= 0) {
+				return false;
+			} else if (slice > ARU_WAIT_PARK_NS) {
+				slice = ARU_WAIT_PARK_NS;
+			}
+		}
+
+		futex_wait(tag, ARU_TAG_WAITING, slice);
+
+		if (ARU_TAG_IS_DONE(atomic_load(tag))) {
+			return true;
+		}
+
+		if (aru != NULL && !aru->enqueue_only) {
+			aru_sync(aru);
+		}
+	}
+}
+
+/*
+ * aru_set_help_budget - Bound the helping work of submitting threads
+ * @aru: pointer of the aru
+ * @max_nodes: callbacks a submitter may execute per call, 0 if unbounded
+ * @max_ns: time a submitter may spend executing per call, 0 if unbounded
+ *
+ * The budget applies to aru_update(), aru_read() and the other asynchronous
+ * submission APIs. aru_sync(), aru_wait() and the synchronous submission APIs
+ * are not bounded. Should be set before the aru is shared between threads.
+ */
+void aru_set_help_budget(struct aru *aru, uint32_t max_nodes, int64_t max_ns)
+{
+	aru->help_max_nodes = max_nodes;
+	aru->help_max_ns = max_ns;
+}
+
+/*
+ * aru_set_enqueue_only - Make submitters only publish their nodes
+ * @aru: pointer of the aru
+ * @enqueue_only: true to stop submitters from executing callbacks
+ *
+ * In enqueue-only mode, the submission APIs insert the node and return without
+ * traversing the list. The synchronous APIs and aru_wait() park instead of
+ * helping. Callbacks are executed only by drainer threads and by explicit
+ * aru_sync() calls. Should be set before the aru is shared between threads.
+ */
+void aru_set_enqueue_only(struct aru *aru, bool enqueue_only)
+{
+	aru->enqueue_only = enqueue_only;
+}
+
+/*
+ * aru_start_drainers - Start threads dedicated to executing the aru's nodes
+ * @aru: pointer of the aru
+ * @nthreads: number of drainer threads
+ *
+ * The drainers run until the aru is destroyed. Can be called only once per
+ * aru. Returns true on success, false on failure.
+ */
+bool aru_start_drainers(struct aru *aru, int nthreads)
+{
+	int i;
+
+	if (aru->drainers != NULL || nthreads <= 0) {
+		fprintf(stderr, "aru_start_drainers: invalid request\n");
+		return false;
+	}
+
+	aru->drainers = calloc(nthreads, sizeof(pthread_t));
+	if (aru->drainers == NULL) {
+		fprintf(stderr, "aru_start_drainers: drainer allocation failed\n");
+		return false;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&aru->drainers[i], NULL, drainer_main, aru) != 0) {
+			fprintf(stderr, "aru_start_drainers: pthread_create() failed\n");
+			aru->drainer_count = i;
+			stop_drainers(aru);
+			atomic_store(&aru->drain_stop, false);
+			return false;
+		}
+	}
+	aru->drainer_count = nthreads;
+
+	return true;
+}
+
+/*
+ * aru_executor_init - Create a thread pool serving many arus
+ * @nthreads: number of worker threads
+ *
+ * Returns pointer to an aru_executor, or NULL on failure.
+ */
+struct aru_executor *aru_executor_init(int nthreads)
+{
+	struct aru_executor *executor = NULL;
+	int i;
+
+	if (nthreads <= 0) {
+		fprintf(stderr, "aru_executor_init: invalid thread count\n");
+		return NULL;
+	}
+
+	executor = calloc(1, sizeof(struct aru_executor));
+	if (executor == NULL) {
+		fprintf(stderr, "aru_executor_init: executor allocation failed\n");
+		return NULL;
+	}
+
+	executor->workers = aligned_alloc(64,
+		sizeof(struct aru_executor_worker) * nthreads);
+	if (executor->workers == NULL) {
+		fprintf(stderr, "aru_executor_init: worker allocation failed\n");
+		free(executor);
+		return NULL;
+	}
+	memset(executor->workers, 0, sizeof(struct aru_executor_worker) * nthreads);
+
+	for (i = 0; i < nthreads; i++) {
+		executor->workers[i].executor = executor;
+		pthread_mutex_init(&executor->workers[i].lock, NULL);
+	}
+
+	/* Queues must be ready before any worker starts stealing */
+	executor->worker_count = nthreads;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&executor->workers[i].thread, NULL,
+				executor_worker_main, &executor->workers[i]) != 0) {
+			fprintf(stderr, "aru_executor_init: pthread_create() failed\n");
+			executor->worker_count = i;
+			aru_executor_destroy(executor);
+			return NULL;
+		}
+	}
+
+	return executor;
+}
+
+/*
+ * aru_executor_destroy - Stop the workers and destroy the executor
+ * @executor: pointer of the aru_executor
+ *
+ * Every aru attached to the executor must be destroyed before this.
+ */
+void aru_executor_destroy(struct aru_executor *executor)
+{
+	int i;
+
+	if (executor == NULL) {
+		return;
+	}
+
+	atomic_store(&executor->stop, true);
+	atomic_fetch_add(&executor->doorbell, 1);
+	futex_wake((uint32_t *)&executor->doorbell, INT_MAX);
+
+	for (i = 0; i < executor->worker_count; i++) {
+		pthread_join(executor->workers[i].thread, NULL);
+		pthread_mutex_destroy(&executor->workers[i].lock);
+	}
+
+	free(executor->workers);
+	free(executor);
+}
+
+/*
+ * aru_set_executor - Let a shared executor execute the aru's nodes
+ * @aru: pointer of the aru
+ * @executor: pointer of the aru_executor
+ *
+ * Puts the aru in enqueue-only mode. Should be set before the aru is shared
+ * between threads.
+ */
+void aru_set_executor(struct aru *aru, struct aru_executor *executor)
+{
+	aru->executor = executor;
+	aru->enqueue_only = true;
+}
+
+/*
+ * aru_set_reclaim_granularity - Move the tail only in steps of several nodes
+ * @aru: pointer of the aru
+ * @nodes: minimum number of completed nodes per tail movement, at least 1
+ *
+ * Should be set before the aru is shared between threads.
+ */
+void aru_set_reclaim_granularity(struct aru *aru, uint64_t nodes)
+{
+	aru->reclaim_nodes = nodes > 0 ? nodes : 1;
+}
+
+/*
+ * aru_set_deferred_reclaim - Leave retired node ranges to aru_reclaim()
+ * @aru: pointer of the aru
+ * @deferred: true to defer, false to free them where they retire
+ *
+ * Should be set before the aru is shared between threads.
+ */
+void aru_set_deferred_reclaim(struct aru *aru, bool deferred)
+{
+	aru->deferred_reclaim = deferred;
+}
+
+/*
+ * aru_reclaim - Free the node ranges retired so far
+ * @aru: pointer of the aru
+ *
+ * Returns the number of freed nodes.
+ */
+size_t aru_reclaim(struct aru *aru)
+{
+	struct aru_tail_version *tail_version = atomic_exchange(&aru->retired,
+		NULL), *next = NULL;
+	size_t count = 0;
+
+	while (tail_version != NULL) {
+		next = tail_version->retired_next;
+		count += reclaim_tail_version(tail_version);
+		tail_version = next;
+	}
+
+	return count;
+}
+
+/*
+ * aru_start_reclaimer - Start a thread freeing the retired node ranges
+ * @aru: pointer of the aru
+ *
+ * Turns on deferred reclamation. The reclaimer runs until the aru is
+ * destroyed. Can be called only once per aru. Returns true on success, false
+ * on failure.
+ */
+bool aru_start_reclaimer(struct aru *aru)
+{
+	if (aru->reclaimer_running) {
+		fprintf(stderr, "aru_start_reclaimer: invalid request\n");
+		return false;
+	}
+
+	aru->deferred_reclaim = true;
+
+	if (pthread_create(&aru->reclaimer, NULL, reclaimer_main, aru) != 0) {
+		fprintf(stderr, "aru_start_reclaimer: pthread_create() failed\n");
+		return false;
+	}
+	aru->reclaimer_running = true;
+
+	return true;
+}
+
+/*
+ * aru_set_fast_path - Enable or disable inline execution on an idle aru
+ * @aru: pointer of the aru
+ * @enabled: whether callers may run their callback inline
+ *
+ * Should be set before the aru is shared between threads.
+ */
+void aru_set_fast_path(struct aru *aru, bool enabled)
+{
+	aru->fast_path = enabled;
+}
+
+/*
+ * aru_update_keyed - Update API whose pending updates coalesce per key
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @key: updates with the same key supersede each other
+ * @update: user's update function
+ * @args: update function's arguments
+ *
+ * Same as aru_update(), but an update that has not started yet is skipped once
+ * a newer keyed update with the same key is queued behind it.
+ */
+void aru_update_keyed(struct aru *aru, aru_tag *tag, uint64_t key,
+	void (*update)(void *args), void *args)
+{
+	struct aru_node *node = NULL;
+	bool bounded = true;
+
+	if (execute_inline(aru, tag, update, args)) {
+		return;
+	}
+
+	node = aru_slab_alloc(ARU_SLAB_CLASS_NODE);
+	if (node == NULL) {
+		fprintf(stderr, "aru_update_keyed(): aru_node allocation failed\n");
+		return;
+	}
+
+	init_node(node, ARU_NODE_TYPE_UPDATE, tag, update, args, NULL);
+	node->flags = ARU_NODE_FLAG_KEYED;
+	node->key = key;
+
+	bounded = !insert_keyed_node(aru, node);
+
+	execute_after_insert(aru, node, bounded);
+}
+
+/*
+ * aru_read_shared - Read API for idempotent reads that may be served together
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @read: user's read function
+ * @args: read function's arguments
+ *
+ * Same as aru_read(), but pending shared reads with the same @read and @args
+ * and no update between them are completed by a single callback.
+ */
+void aru_read_shared(struct aru *aru, aru_tag *tag,
+	void (*read)(void *args), void *args)
+{
+	struct aru_node *node = NULL;
+
+	node = aru_slab_alloc(ARU_SLAB_CLASS_NODE);
+	if (node == NULL) {
+		fprintf(stderr, "aru_read_shared(): aru_node allocation failed\n");
+		return;
+	}
+
+	init_node(node, ARU_NODE_TYPE_READ, tag, read, args, NULL);
+	node->flags = ARU_NODE_FLAG_SHARED;
+
+	insert_nodes_and_execute(aru, node, node);
+}
+
+/*
+ * aru_enable_snapshots - Publish an immutable snapshot after updates
+ * @aru: pointer of the aru
+ * @clone: user's hook returning an immutable copy of the state
+ * @release: user's hook freeing a snapshot returned by @clone
+ * @ctx: argument passed to both hooks
+ *
+ * Publishes the first snapshot right away. Should be called before the aru is
+ * shared between threads. Returns true on success, false on failure.
+ */
+bool aru_enable_snapshots(struct aru *aru, void *(*clone)(void *ctx),
+	void (*release)(void *snapshot, void *ctx), void *ctx)
+{
+	struct atomsnap_init_context gate_ctx = {
+		.atomsnap_alloc_impl = aru_snapshot_version_alloc,
+		.atomsnap_free_impl = aru_snapshot_version_free
+	};
+
+	if (aru->snapshot != NULL || clone == NULL || release == NULL) {
+		fprintf(stderr, "aru_enable_snapshots: invalid request\n");
+		return false;
+	}
+
+	aru->snapshot_clone = clone;
+	aru->snapshot_release = release;
+	aru->snapshot_ctx = ctx;
+
+	aru->snapshot = atomsnap_init_gate(&gate_ctx);
+	if (aru->snapshot == NULL) {
+		fprintf(stderr, "aru_enable_snapshots: atomsnap_init_gate() failed\n");
+		return false;
+	}
+
+	publish_snapshot(aru);
+
+	return true;
+}
+
+/*
+ * aru_read_snapshot - Run a read against the latest snapshot
+ * @aru: pointer of the aru
+ * @read: user's read function, called with the snapshot and @args
+ * @args: read function's arguments
+ *
+ * Returns false if snapshots are not enabled, true otherwise.
+ */
+bool aru_read_snapshot(struct aru *aru,
+	void (*read)(void *snapshot, void *args), void *args)
+{
+	struct atomsnap_version *version = NULL;
+
+	if (aru->snapshot == NULL) {
+		return false;
+	}
+
+	version = atomsnap_acquire_version(aru->snapshot);
+
+	read(version->object, args);
+
+	atomsnap_release_version(version);
+
+	return true;
+}
+
+/* Attempts of aru_read_optimistic() before it falls back to the queue */
+#define ARU_OPTIMISTIC_RETRIES (4)
+
+/*
+ * aru_read_optimistic - Read API running the callback without a node
+ * @aru: pointer of the aru
+ * @read: user's read function, must tolerate racing with an update
+ * @args: read function's arguments
+ *
+ * Run the callback while no update is in progress, and accept the result if no
+ * update began meanwhile, like a seqlock reader. Otherwise retry, and after
+ * ARU_OPTIMISTIC_RETRIES attempts, fall back to aru_read_sync().
+ *
+ * Returns true if the read was validated without the queue.
+ */
+bool aru_read_optimistic(struct aru *aru, void (*read)(void *args), void *args)
+{
+	uint64_t begin, end;
+	int i;
+
+	for (i = 0; i < ARU_OPTIMISTIC_RETRIES; i++) {
+		/* The end counter first, so that equal counters mean no update ran */
+		end = atomic_load_explicit(&aru->update_end, memory_order_acquire);
+		begin = atomic_load_explicit(&aru->update_begin, memory_order_acquire);
+		if (begin != end) {
+			__asm__ __volatile__("pause");
+			continue;
+		}
+
+		read(args);
+
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&aru->update_begin,
+				memory_order_relaxed) == begin) {
+			return true;
+		}
+	}
+
+	aru_read_sync(aru, read, args);
+
+	return false;
+}
+
+/*
+ * aru_update2 - Split-phase update API
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @prepare: user's function run before ordering, may be NULL
+ * @commit: user's update function
+ * @args: arguments of both functions
+ *
+ * Run @prepare in the calling thread, then submit @commit like aru_update().
+ */
+void aru_update2(struct aru *aru, aru_tag *tag, void (*prepare)(void *args),
+	void (*commit)(void *args), void *args)
+{
+	if (prepare != NULL) {
+		prepare(args);
+	}
+
+	aru_update(aru, tag, commit, args);
+}
+
+/*
+ * aru_set_batch_hooks - Register hooks around each run of callbacks
+ * @aru: pointer of the aru
+ * @begin_batch: called before the first callback of a run, may be NULL
+ * @end_batch: called after the last callback of a run, may be NULL
+ * @ctx: argument passed to both hooks
+ *
+ * Should be set before the aru is shared between threads.
+ */
+void aru_set_batch_hooks(struct aru *aru, void (*begin_batch)(void *ctx),
+	void (*end_batch)(void *ctx), void *ctx)
+{
+	aru->begin_batch = begin_batch;
+	aru->end_batch = end_batch;
+	aru->batch_ctx = ctx;
+}
+
+/*
+ * aru_update_masked - Update API that only conflicts with overlapping updates
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @mask: conflict domains touched by the update, one bit per domain
+ * @update: user's update function
+ * @args: update function's arguments
+ *
+ * With snapshots enabled, every update has to run exclusively for the clone
+ * hook, so @mask is ignored.
+ */
+void aru_update_masked(struct aru *aru, aru_tag *tag, uint16_t mask,
+	void (*update)(void *args), void *args)
+{
+	struct aru_node *node = NULL;
+
+	if (execute_inline(aru, tag, update, args)) {
+		return;
+	}
+
+	node = aru_slab_alloc(ARU_SLAB_CLASS_NODE);
+	if (node == NULL) {
+		fprintf(stderr, "aru_update_masked(): aru_node allocation failed\n");
+		return;
+	}
+
+	init_node(node, ARU_NODE_TYPE_UPDATE, tag, update, args, NULL);
+	if (mask != 0 && aru->snapshot == NULL) {
+		node->flags = ARU_NODE_FLAG_MASKED;
+		node->mask = mask;
+	}
+
+	insert_nodes_and_execute(aru, node, node);
+}
+
+/*
+ * aru_shard_hold - State of a shard held by aru_sharded_read_all()
+ * @tail: tail version keeping @head alive, NULL if the shard is unused
+ * @head: head seen right after the inline owner flag was taken
+ *
+ * Only the thread holding the shard's inline owner flag touches its hold.
+ */
+struct aru_shard_hold {
+	struct aru_tail_version *tail;
+	struct aru_node *head;
+};
 
-		tail->head_node = NULL;
-		tail->tail_node = node;
+/*
+ * aru_sharded - aru partitioned by key into independent shards
+ * @shards: one aru per shard, each with its own head
+ * @holds: one hold per shard, see aru_sharded_read_all()
+ * @shard_count: number of @shards
+ */
+struct aru_sharded {
+	struct aru **shards;
+	struct aru_shard_hold *holds;
+	int shard_count;
+};
 
-		atomsnap_exchange_version(aru->tail, (struct atomsnap_version *)tail);
+/*
+ * quiesce_shard - Take the inline owner flag of a shard and drain it
+ * @aru: the shard
+ * @head: returns the head seen right after the flag was taken
+ *
+ * Once the flag is set, nodes inserted afterwards are left alone by other
+ * threads, just as with execute_inline(). Nodes inserted before may still be
+ * claimed, but every one of them is at or before @head, so we execute the
+ * shard ourselves until @head and all nodes before it are done.
+ *
+ * Returns the tail version keeping @head alive, NULL if the shard is unused.
+ */
+static struct aru_tail_version *quiesce_shard(struct aru *aru,
+	struct aru_node **head)
+{
+	struct aru_tail_version *tail = NULL, *current = NULL;
+	bool expected = false;
+	uint64_t seq = 0;
+
+	while (!atomic_compare_exchange_weak(&aru->inline_owner, &expected,
+			true)) {
+		expected = false;
+		__asm__ __volatile__("pause");
+	}
 
-		atomic_store(&aru->tail_init_flag, 1);
-	} else {
-		prev_head->next = node;
-		node->prev = prev_head;
+	tail = (struct aru_tail_version *)atomsnap_acquire_version(aru->tail);
+	*head = atomic_load(&aru->head);
+	if (tail == NULL) {
+		return NULL;
+	}
 
-		/* Initial state */
-		while (atomic_load(&aru->tail_init_flag) == 0) {
-			__asm__ __volatile__("pause");
+	for (;;) {
+		seq = atomic_load(&(*head)->seq);
+		if (atomic_load(&(*head)->tag) == ARU_TAG_DONE && seq != 0 &&
+				atomic_load(&aru->completed_all) >= seq) {
+			break;
 		}
+
+		current = (struct aru_tail_version *)atomsnap_acquire_version(
+			aru->tail);
+		execute_nodes_and_adjust_tail(aru, current, current->tail_node,
+			false, true);
+		atomsnap_release_version((struct atomsnap_version *)current);
 	}
 
-	tail = (struct aru_tail_version *)atomsnap_acquire_version(aru->tail);
+	return tail;
+}
 
-	execute_nodes_and_adjust_tail(aru, tail, node);
+/*
+ * Returns pointer to a sharded aru with @nshards shards, or NULL on failure.
+ */
+struct aru_sharded *aru_sharded_init(int nshards)
+{
+	struct aru_sharded *sharded = NULL;
+	int i;
 
-	atomsnap_release_version((struct atomsnap_version *)tail);
+	if (nshards <= 0) {
+		fprintf(stderr, "aru_sharded_init: invalid shard count\n");
+		return NULL;
+	}
+
+	sharded = calloc(1, sizeof(struct aru_sharded));
+	if (sharded == NULL) {
+		fprintf(stderr, "aru_sharded_init: allocation failed\n");
+		return NULL;
+	}
+
+	sharded->shards = calloc(nshards, sizeof(struct aru *));
+	sharded->holds = calloc(nshards, sizeof(struct aru_shard_hold));
+	if (sharded->shards == NULL || sharded->holds == NULL) {
+		fprintf(stderr, "aru_sharded_init: shard allocation failed\n");
+		free(sharded->shards);
+		free(sharded->holds);
+		free(sharded);
+		return NULL;
+	}
+
+	for (i = 0; i < nshards; i++) {
+		sharded->shards[i] = aru_init();
+		if (sharded->shards[i] == NULL) {
+			fprintf(stderr, "aru_sharded_init: aru_init() failed\n");
+			sharded->shard_count = i;
+			aru_sharded_destroy(sharded);
+			return NULL;
+		}
+	}
+	sharded->shard_count = nshards;
+
+	return sharded;
 }
 
 /*
- * aru_update - Update API provided to the user
- * @aru: pointer of the aru
+ * Destroy the given sharded aru and its shards.
+ */
+void aru_sharded_destroy(struct aru_sharded *sharded)
+{
+	int i;
+
+	if (sharded == NULL) {
+		return;
+	}
+
+	for (i = 0; i < sharded->shard_count; i++) {
+		aru_destroy(sharded->shards[i]);
+	}
+
+	free(sharded->shards);
+	free(sharded->holds);
+	free(sharded);
+}
+
+/*
+ * aru_sharded_shard - Find the shard serving the given key
+ * @sharded: pointer of the sharded aru
+ * @key: user's key
+ */
+struct aru *aru_sharded_shard(struct aru_sharded *sharded, uint64_t key)
+{
+	return sharded->shards[((key * 0x9E3779B97F4A7C15ULL) >> 32) %
+		(uint64_t)sharded->shard_count];
+}
+
+/*
+ * aru_sharded_update - aru_update() on the shard serving the key
+ * @sharded: pointer of the sharded aru
+ * @key: user's key
  * @tag: status representing progress or result
  * @update: user's update function
  * @args: update function's arguments
+ */
+void aru_sharded_update(struct aru_sharded *sharded, uint64_t key,
+	aru_tag *tag, void (*update)(void *args), void *args)
+{
+	aru_update(aru_sharded_shard(sharded, key), tag, update, args);
+}
+
+/*
+ * aru_sharded_read - aru_read() on the shard serving the key
+ * @sharded: pointer of the sharded aru
+ * @key: user's key
+ * @tag: status representing progress or result
+ * @read: user's read function
+ * @args: read function's arguments
+ */
+void aru_sharded_read(struct aru_sharded *sharded, uint64_t key,
+	aru_tag *tag, void (*read)(void *args), void *args)
+{
+	aru_read(aru_sharded_shard(sharded, key), tag, read, args);
+}
+
+/*
+ * aru_sharded_read_all - Run one read against all shards at once
+ * @sharded: pointer of the sharded aru
+ * @read: user's read function
+ * @args: read function's arguments
  *
- * The user expects the update logic passed to this function to be executed
- * asynchronously, ensuring a critical section without interference from other
- * threads.
+ * Quiesce the shards one by one and hold them, then run the read. Concurrent
+ * callers take the shards in the same order, so they cannot hold a shard the
+ * other one waits for. What we keep about a held shard lives in its hold.
  *
- * The user can pass a tag as an argument to track the update status. If the tag
- * is NULL, no status will be provided.
+ * Nodes held back meanwhile may have nobody left to execute them, so drain the
+ * shards whose head has moved, as execute_inline() does.
  */
-void aru_update(struct aru *aru, aru_tag *tag,
-	void (*update)(void *args), void *args)
+void aru_sharded_read_all(struct aru_sharded *sharded,
+	void (*read)(void *args), void *args)
 {
-	struct aru_node *node = calloc(1, sizeof(struct aru_node));
+	struct aru_shard_hold *hold = NULL;
+	struct aru_tail_version *tail = NULL;
+	struct aru_node *head = NULL;
+	struct aru *shard = NULL;
+	bool moved;
+	int i;
+
+	for (i = 0; i < sharded->shard_count; i++) {
+		hold = &sharded->holds[i];
+		hold->tail = quiesce_shard(sharded->shards[i], &hold->head);
+	}
 
-	if (node == NULL) {
-		fprintf(stderr, "aru_update(): aru_node allocation failed\n");
-		return;
+	read(args);
+
+	for (i = 0; i < sharded->shard_count; i++) {
+		shard = sharded->shards[i];
+		hold = &sharded->holds[i];
+
+		/* The hold belongs to the next caller once the flag is cleared */
+		tail = hold->tail;
+		head = hold->head;
+
+		atomic_store(&shard->inline_owner, false);
+		moved = (atomic_load(&shard->head) != head);
+
+		if (tail != NULL) {
+			atomsnap_release_version((struct atomsnap_version *)tail);
+		}
+
+		if (moved) {
+			aru_sync(shard);
+		}
 	}
+}
 
-	node->callback = update;
-	node->args = args;
-	node->user_tag_ptr = tag;
+/* Entries of the operation log of a replicated object, a power of two */
+#define ARU_REPLICA_LOG_SIZE (4096)
 
-	node->tag = ARU_TAG_PENDING;
-	if (tag != NULL) {
-		*tag = node->tag;
+/*
+ * aru_replica - Copy of a replicated object used by one NUMA node
+ * @lock: held for reading by local readers, for writing while applying the log
+ * @object: the copy made by the user's factory
+ * @applied: number of log entries applied to @object
+ */
+struct aru_replica {
+	pthread_rwlock_t lock;
+	void *object;
+	_Atomic uint64_t applied;
+} __attribute__((aligned(64)));
+
+/*
+ * aru_replicated - Object replicated per NUMA node, see aru_replicated_init()
+ * @aru: orders the updates, whose callbacks append them to @log
+ * @replicas: one replica per NUMA node
+ * @replica_count: number of @replicas
+ * @destroy: user's hook freeing a replica
+ * @ctx: argument of the user's hooks
+ * @log: ring of the most recent ARU_REPLICA_LOG_SIZE updates
+ * @log_tail: number of updates ever appended to @log
+ *
+ * @log is only written by aru callbacks, which run one at a time, so it has a
+ * single writer. An entry is overwritten only after every replica has applied
+ * it.
+ */
+struct aru_replicated {
+	struct aru *aru;
+	struct aru_replica *replicas;
+	int replica_count;
+	void (*destroy)(void *replica, void *ctx);
+	void *ctx;
+	struct aru_replica_entry *log;
+	ARU_CACHELINE_ALIGNED _Atomic uint64_t log_tail;
+};
+
+/*
+ * catch_up_replica - Apply the log entries the replica has not seen yet
+ * @replicated: pointer of the replicated object
+ * @replica: replica to bring up to date
+ */
+static void catch_up_replica(struct aru_replicated *replicated,
+	struct aru_replica *replica)
+{
+	struct aru_replica_entry *entry = NULL;
+	uint64_t applied, tail;
+
+	pthread_rwlock_wrlock(&replica->lock);
+
+	applied = atomic_load(&replica->applied);
+	tail = atomic_load_explicit(&replicated->log_tail, memory_order_acquire);
+	while (applied < tail) {
+		entry = &replicated->log[applied & (ARU_REPLICA_LOG_SIZE - 1)];
+		entry->update(replica->object, entry->args);
+		applied++;
 	}
+	atomic_store(&replica->applied, applied);
 
-	pthread_spin_init(&node->lock, PTHREAD_PROCESS_PRIVATE);
+	pthread_rwlock_unlock(&replica->lock);
+}
+
+/*
+ * append_replica_log - aru callback appending an update to the log
+ * @args: aru_replica_entry of the update
+ *
+ * If the oldest entry is still needed by a replica, apply the log to that
+ * replica first. This only happens if a NUMA node has not read for a whole log.
+ */
+static void append_replica_log(void *args)
+{
+	struct aru_replica_entry *op = (struct aru_replica_entry *)args;
+	struct aru_replicated *replicated = op->replicated;
+	uint64_t tail = atomic_load(&replicated->log_tail);
+	struct aru_replica_entry *entry
+		= &replicated->log[tail & (ARU_REPLICA_LOG_SIZE - 1)];
+	int i;
+
+	for (i = 0; i < replicated->replica_count; i++) {
+		if (tail - atomic_load(&replicated->replicas[i].applied) >=
+				ARU_REPLICA_LOG_SIZE) {
+			catch_up_replica(replicated, &replicated->replicas[i]);
+		}
+	}
 
-	node->type = ARU_NODE_TYPE_UPDATE;
+	entry->update = op->update;
+	entry->args = op->args;
+	atomic_store_explicit(&replicated->log_tail, tail + 1,
+		memory_order_release);
 
-	insert_node_and_execute(aru, node);
+	aru_slab_free(op);
 }
 
 /*
- * aru_read - Read API provided to the user
- * @aru: pointer of the aru
+ * aru_replicated_init - Create an object replicated per NUMA node
+ * @nreplicas: number of replicas, 0 or less for one per NUMA node
+ * @factory: user's hook returning the initial replica for the given node
+ * @destroy: user's hook freeing a replica, may be NULL
+ * @ctx: argument of both hooks
+ *
+ * Returns pointer to the replicated object, or NULL on failure.
+ */
+struct aru_replicated *aru_replicated_init(int nreplicas,
+	void *(*factory)(int node, void *ctx),
+	void (*destroy)(void *replica, void *ctx), void *ctx)
+{
+	struct aru_replicated *replicated = NULL;
+	int i;
+
+	if (factory == NULL) {
+		fprintf(stderr, "aru_replicated_init: invalid request\n");
+		return NULL;
+	}
+
+	if (nreplicas <= 0) {
+		nreplicas = numa_node_count();
+	}
+
+	replicated = aligned_alloc(_Alignof(struct aru_replicated),
+		sizeof(struct aru_replicated));
+	if (replicated == NULL) {
+		fprintf(stderr, "aru_replicated_init: allocation failed\n");
+		return NULL;
+	}
+	memset(replicated, 0, sizeof(struct aru_replicated));
+
+	replicated->destroy = destroy;
+	replicated->ctx = ctx;
+
+	replicated->log = calloc(ARU_REPLICA_LOG_SIZE,
+		sizeof(struct aru_replica_entry));
+	replicated->replicas = aligned_alloc(_Alignof(struct aru_replica),
+		sizeof(struct aru_replica) * nreplicas);
+	replicated->aru = aru_init();
+	if (replicated->log == NULL || replicated->replicas == NULL ||
+			replicated->aru == NULL) {
+		fprintf(stderr, "aru_replicated_init: allocation failed\n");
+		aru_replicated_destroy(replicated);
+		return NULL;
+	}
+	memset(replicated->replicas, 0, sizeof(struct aru_replica) * nreplicas);
+
+	for (i = 0; i < nreplicas; i++) {
+		pthread_rwlock_init(&replicated->replicas[i].lock, NULL);
+		replicated->replicas[i].object = factory(numa_node_id(i), ctx);
+		replicated->replica_count = i + 1;
+
+		if (replicated->replicas[i].object == NULL) {
+			fprintf(stderr, "aru_replicated_init: factory failed\n");
+			aru_replicated_destroy(replicated);
+			return NULL;
+		}
+	}
+
+	return replicated;
+}
+
+/*
+ * Destroy the given replicated object and its replicas.
+ */
+void aru_replicated_destroy(struct aru_replicated *replicated)
+{
+	int i;
+
+	if (replicated == NULL) {
+		return;
+	}
+
+	if (replicated->aru != NULL) {
+		aru_sync(replicated->aru);
+		aru_destroy(replicated->aru);
+	}
+
+	for (i = 0; i < replicated->replica_count; i++) {
+		if (replicated->destroy != NULL) {
+			replicated->destroy(replicated->replicas[i].object,
+				replicated->ctx);
+		}
+		pthread_rwlock_destroy(&replicated->replicas[i].lock);
+	}
+
+	free(replicated->replicas);
+	free(replicated->log);
+	free(replicated);
+}
+
+/*
+ * aru_replicated_update - Log an update to be applied to every replica
+ * @replicated: pointer of the replicated object
  * @tag: status representing progress or result
- * @read: user's read function
+ * @update: user's update function, called with a replica and @args
+ * @args: update function's arguments
+ *
+ * The update goes through the aru like aru_update(), and its callback only
+ * appends it to the log. The tag is done once the update is logged.
+ */
+void aru_replicated_update(struct aru_replicated *replicated, aru_tag *tag,
+	void (*update)(void *replica, void *args), void *args)
+{
+	struct aru_replica_entry *op = aru_slab_alloc(ARU_SLAB_CLASS_REPLICA_OP);
+
+	if (op == NULL) {
+		fprintf(stderr, "aru_replicated_update(): allocation failed\n");
+		return;
+	}
+
+	op->replicated = replicated;
+	op->update = update;
+	op->args = args;
+
+	aru_update(replicated->aru, tag, append_replica_log, op);
+}
+
+static _Thread_local int aru_replica_hint = -1;
+
+/*
+ * replica_of_thread - Find the replica of the calling thread's NUMA node
+ * @replicated: pointer of the replicated object
+ *
+ * Looking up the NUMA node enters the kernel, so it is done once per thread.
+ * A thread that migrates keeps reading its first replica, which is only
+ * slower, since every replica is brought up to date before it is read.
+ */
+static struct aru_replica *replica_of_thread(struct aru_replicated *replicated)
+{
+	if (aru_replica_hint < 0) {
+		aru_replica_hint = current_numa_index();
+	}
+
+	return &replicated->replicas[aru_replica_hint % replicated->replica_count];
+}
+
+/*
+ * aru_replicated_read - Read the replica of the caller's NUMA node
+ * @replicated: pointer of the replicated object
+ * @read: user's read function, called with the replica and @args
  * @args: read function's arguments
  *
- * The user expects the read logic passed to this function to be executed
- * asynchronously. The read function will be executed after all previously
- * requested updates have been applied. Unlike the update logic, multiple read
- * operations can run concurrently, but update operations are not to be executed
- * simultaneously.
+ * Bring the local replica up to date with the log first, then read it. Local
+ * readers share the replica, and only exclude each other while catching up.
+ */
+void aru_replicated_read(struct aru_replicated *replicated,
+	void (*read)(void *replica, void *args), void *args)
+{
+	struct aru_replica *replica = replica_of_thread(replicated);
+
+	for (;;) {
+		pthread_rwlock_rdlock(&replica->lock);
+		if (atomic_load(&replica->applied) ==
+				atomic_load_explicit(&replicated->log_tail,
+					memory_order_acquire)) {
+			break;
+		}
+		pthread_rwlock_unlock(&replica->lock);
+
+		catch_up_replica(replicated, replica);
+	}
+
+	read(replica->object, args);
+
+	pthread_rwlock_unlock(&replica->lock);
+}
+
+/*
+ * aru_replicated_sync - Apply every logged update to every replica
+ * @replicated: pointer of the replicated object
+ */
+void aru_replicated_sync(struct aru_replicated *replicated)
+{
+	int i;
+
+	aru_sync(replicated->aru);
+
+	for (i = 0; i < replicated->replica_count; i++) {
+		catch_up_replica(replicated, &replicated->replicas[i]);
+	}
+}
+
+/*
+ * dispatch_cmd - Callback of the command nodes
+ * @args: pointer of the aru_cmd
+ */
+static void dispatch_cmd(void *args)
+{
+	struct aru_cmd *cmd = (struct aru_cmd *)args;
+
+	cmd->handler(cmd->payload, cmd->len, cmd->ctx);
+}
+
+/*
+ * aru_set_commands - Register the command table of the aru
+ * @aru: pointer of the aru
+ * @commands: command table, indexed by opcode, must outlive the aru
+ * @count: number of @commands
+ * @ctx: argument passed to every handler
  *
- * The user can pass a tag as an argument to track the update status. If the tag
- * is NULL, no status will be provided.
+ * Should be set before the aru is shared between threads.
  */
-void aru_read(struct aru *aru, aru_tag *tag,
-	void (*read)(void *args), void *args)
+void aru_set_commands(struct aru *aru, const struct aru_command *commands,
+	uint32_t count, void *ctx)
 {
-	struct aru_node *node = calloc(1, sizeof(struct aru_node));
+	aru->commands = commands;
+	aru->command_count = count;
+	aru->command_ctx = ctx;
+}
 
-	if (node == NULL) {
-		fprintf(stderr, "aru_update(): aru_node allocation failed\n");
-		return;
+/*
+ * aru_submit_cmd - Submit a command with its payload copied into the node
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @opcode: index of the command in the aru's command table
+ * @payload: payload passed to the command's handler
+ * @len: length of @payload, at most ARU_CMD_PAYLOAD_MAX
+ *
+ * On the fast path the handler reads the caller's payload directly, without a
+ * copy. Returns true on success, false if the command cannot be submitted.
+ */
+bool aru_submit_cmd(struct aru *aru, aru_tag *tag, uint32_t opcode,
+	const void *payload, size_t len)
+{
+	const struct aru_command *command = NULL;
+	struct aru_cmd_node *cmd_node = NULL;
+	struct aru_cmd cmd;
+
+	if (opcode >= aru->command_count || len > ARU_CMD_PAYLOAD_MAX) {
+		fprintf(stderr, "aru_submit_cmd(): invalid command\n");
+		return false;
 	}
 
-	node->callback = read;
-	node->args = args;
-	node->user_tag_ptr = tag;
+	command = &aru->commands[opcode];
+	if (command->type != ARU_NODE_TYPE_UPDATE &&
+			command->type != ARU_NODE_TYPE_READ) {
+		fprintf(stderr, "aru_submit_cmd(): invalid command type\n");
+		return false;
+	}
 
-	node->tag = ARU_TAG_PENDING;
-	if (tag != NULL) {
-		*tag = node->tag;
+	cmd.handler = command->handler;
+	cmd.payload = payload;
+	cmd.len = len;
+	cmd.ctx = aru->command_ctx;
+
+	if (command->type == ARU_NODE_TYPE_UPDATE &&
+			execute_inline(aru, tag, dispatch_cmd, &cmd)) {
+		return true;
+	}
+
+	cmd_node = aru_slab_alloc(ARU_SLAB_CLASS_CMD);
+	if (cmd_node == NULL) {
+		fprintf(stderr, "aru_submit_cmd(): aru_node allocation failed\n");
+		return false;
 	}
 
-	pthread_spin_init(&node->lock, PTHREAD_PROCESS_PRIVATE);
+	memcpy(cmd_node->payload, payload, len);
+	cmd_node->cmd.handler = command->handler;
+	cmd_node->cmd.payload = cmd_node->payload;
+	cmd_node->cmd.len = len;
+	cmd_node->cmd.ctx = aru->command_ctx;
+
+	init_node(&cmd_node->node, command->type, tag, dispatch_cmd,
+		&cmd_node->cmd, NULL);
 
-	node->type = ARU_NODE_TYPE_READ;
+	insert_nodes_and_execute(aru, &cmd_node->node, &cmd_node->node);
 
-	insert_node_and_execute(aru, node);
+	return true;
 }
 
 /*
- * aru_sync - Sync API provided to the user
+ * aru_set_lanes - Submit through per-NUMA-node lanes
  * @aru: pointer of the aru
+ * @nlanes: number of lanes, 0 or less for one per NUMA node
  *
- * Explicitly execute the callback function for the given aru in the current
- * thread. For example, if the number of threads executing aru's callback
- * functions is lower than the number of read functions, this can be used to
- * improve read function throughput.
+ * Should be set before the aru is shared between threads. Returns true on
+ * success, false on failure.
  */
-void aru_sync(struct aru *aru)
+bool aru_set_lanes(struct aru *aru, int nlanes)
 {
-	struct aru_tail_version *tail = NULL;
+	if (aru->lanes != NULL) {
+		fprintf(stderr, "aru_set_lanes: invalid request\n");
+		return false;
+	}
 
-	tail = (struct aru_tail_version *)atomsnap_acquire_version(aru->tail);
+	if (nlanes <= 0) {
+		nlanes = numa_node_count();
+	}
 
-	/*
-	 * This function does not insert a new node. Therefore, provide the tail
-	 * node to avoid unnecessary waiting during the traversal.
-	 */
-	execute_nodes_and_adjust_tail(aru, tail, tail->tail_node);
+	aru->lanes = aligned_alloc(_Alignof(struct aru_lane),
+		sizeof(struct aru_lane) * nlanes);
+	if (aru->lanes == NULL) {
+		fprintf(stderr, "aru_set_lanes: lane allocation failed\n");
+		return false;
+	}
+	memset(aru->lanes, 0, sizeof(struct aru_lane) * nlanes);
+	aru->lane_count = nlanes;
 
-	atomsnap_release_version((struct atomsnap_version *)tail);
+	return true;
 }
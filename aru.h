@@ -9,11 +9,76 @@ extern "C" {
 #include <stdint.h>
 
 typedef struct aru aru;
+typedef struct aru_executor aru_executor;
+typedef struct aru_sharded aru_sharded;
+typedef struct aru_replicated aru_replicated;
 typedef uint32_t aru_tag;
 
 #define ARU_TAG_PENDING	(0)
 #define ARU_TAG_DONE	(1)
 
+/* Still pending, and at least one thread is parked in aru_wait() */
+#define ARU_TAG_WAITING	(2)
+
+/* Set along with ARU_TAG_DONE when a keyed update was superseded, not run */
+#define ARU_TAG_SKIPPED	(4)
+
+/* Whether the tag is done, with or without ARU_TAG_SKIPPED */
+#define ARU_TAG_IS_DONE(tag)	(((tag) & ARU_TAG_DONE) != 0)
+
+#define ARU_TYPE_UPDATE	(0)
+#define ARU_TYPE_READ	(1)
+
+/* Largest payload aru_submit_cmd() copies into a node */
+#define ARU_CMD_PAYLOAD_MAX	(192)
+
+/*
+ * aru_command - Entry of an aru's command table
+ * @type: ARU_TYPE_UPDATE / ARU_TYPE_READ
+ * @handler: user's function, called with the command's payload and the ctx
+ *           registered with the table
+ */
+typedef struct aru_command {
+	int type;
+	void (*handler)(const void *payload, size_t len, void *ctx);
+} aru_command;
+
+/*
+ * aru_batch_entry - One request of aru_submit_batch()
+ * @type: ARU_TYPE_UPDATE / ARU_TYPE_READ
+ * @callback: user's update or read function
+ * @args: callback function's arguments
+ * @tag: status representing progress or result, may be NULL
+ */
+typedef struct aru_batch_entry {
+	int type;
+	void (*callback)(void *args);
+	void *args;
+	aru_tag *tag;
+} aru_batch_entry;
+
+/*
+ * aru_node_storage - Memory for a queue node provided by the user
+ *
+ * The user can embed this in their own request object and submit it with
+ * aru_update_node() or aru_read_node(), so that no allocation is needed and
+ * the node shares cache lines with the request payload. The contents are
+ * private to aru.
+ *
+ * If the library is built with ARU_CACHELINE_LAYOUT, the node spreads over
+ * three cache lines, and users must define the same macro.
+ */
+#ifdef ARU_CACHELINE_LAYOUT
+#define ARU_NODE_STORAGE_SIZE	(192)
+#define ARU_NODE_STORAGE_ALIGN	(64)
+#else
+#define ARU_NODE_STORAGE_SIZE	(64)
+#define ARU_NODE_STORAGE_ALIGN	(8)
+#endif
+typedef struct aru_node_storage {
+	uint64_t opaque[ARU_NODE_STORAGE_SIZE / sizeof(uint64_t)];
+} __attribute__((aligned(ARU_NODE_STORAGE_ALIGN))) aru_node_storage;
+
 /*
  * Returns pointer to an aru, or NULL on failure.
  */
@@ -60,6 +125,81 @@ void aru_update(struct aru *aru, aru_tag *tag,
 void aru_read(struct aru *aru, aru_tag *tag,
 	void (*read)(void *args), void *args);
 
+/*
+ * aru_update_sync - Update API that returns after the update is applied
+ * @aru: pointer of the aru
+ * @update: user's update function
+ * @args: update function's arguments
+ *
+ * Same as aru_update(), but the function returns only after the update has
+ * been executed. Until then the calling thread helps executing other nodes, so
+ * there is no wakeup latency once the update is done.
+ */
+void aru_update_sync(struct aru *aru, void (*update)(void *args), void *args);
+
+/*
+ * aru_read_sync - Read API that returns after the read is executed
+ * @aru: pointer of the aru
+ * @read: user's read function
+ * @args: read function's arguments
+ *
+ * Same as aru_read(), but the function returns only after the read has been
+ * executed, so its result can be used right away. Until then the calling
+ * thread helps executing other nodes.
+ */
+void aru_read_sync(struct aru *aru, void (*read)(void *args), void *args);
+
+/*
+ * aru_update_node - Update API using caller-provided node storage
+ * @aru: pointer of the aru
+ * @storage: memory for the queue node, owned by aru until @release is called
+ * @tag: status representing progress or result
+ * @update: user's update function
+ * @args: update function's arguments
+ * @release: called with @storage once aru no longer references it
+ *
+ * Same as aru_update(), but the node lives in @storage instead of being
+ * allocated. The storage must stay valid until @release is called, which
+ * happens when tail reclamation has passed the node or when the aru is
+ * destroyed. Note that this may be well after the update itself has completed.
+ */
+void aru_update_node(struct aru *aru, struct aru_node_storage *storage,
+	aru_tag *tag, void (*update)(void *args), void *args,
+	void (*release)(struct aru_node_storage *storage));
+
+/*
+ * aru_read_node - Read API using caller-provided node storage
+ * @aru: pointer of the aru
+ * @storage: memory for the queue node, owned by aru until @release is called
+ * @tag: status representing progress or result
+ * @read: user's read function
+ * @args: read function's arguments
+ * @release: called with @storage once aru no longer references it
+ *
+ * Same as aru_read(), but the node lives in @storage instead of being
+ * allocated. See aru_update_node() for the lifetime of @storage.
+ */
+void aru_read_node(struct aru *aru, struct aru_node_storage *storage,
+	aru_tag *tag, void (*read)(void *args), void *args,
+	void (*release)(struct aru_node_storage *storage));
+
+/*
+ * aru_submit_batch - Submit several requests at once
+ * @aru: pointer of the aru
+ * @entries: requests in the order they must be applied
+ * @count: number of entries
+ *
+ * Equivalent to calling aru_update() or aru_read() for each entry in array
+ * order, but the whole batch is inserted with a single atomic operation on the
+ * head of the aru. This is useful when one event produces many updates, for
+ * example when a packet carries many deltas of the same book.
+ *
+ * Returns true if the batch was submitted. On allocation failure, returns
+ * false without submitting any entry or touching any tag.
+ */
+bool aru_submit_batch(struct aru *aru, struct aru_batch_entry *entries,
+	size_t count);
+
 /*
  * aru_sync - Sync API provided to the user
  * @aru: pointer of the aru
@@ -71,6 +211,510 @@ void aru_read(struct aru *aru, aru_tag *tag,
  */
 void aru_sync(struct aru *aru);
 
+
+/*
+ * aru_wait - Wait until the given tag becomes ARU_TAG_DONE
+ * @aru: pointer of the aru the tag was submitted to, may be NULL
+ * @tag: tag passed to aru_update(), aru_read() or one of their variants
+ * @timeout_ns: timeout in nanoseconds, negative to wait forever
+ *
+ * The calling thread first helps executing the aru's callbacks, then spins
+ * for an adaptive amount of time, and finally sleeps on a futex until the
+ * thread completing the node wakes it up.
+ *
+ * While a thread is parked, the tag reads ARU_TAG_WAITING instead of
+ * ARU_TAG_PENDING. So check progress with ARU_TAG_IS_DONE().
+ *
+ * Returns true if the tag is done, false on timeout.
+ */
+bool aru_wait(struct aru *aru, aru_tag *tag, int64_t timeout_ns);
+
+/*
+ * aru_set_help_budget - Bound the helping work of submitting threads
+ * @aru: pointer of the aru
+ * @max_nodes: callbacks a submitter may execute per call, 0 if unbounded
+ * @max_ns: time a submitter may spend executing per call, 0 if unbounded
+ *
+ * A submitting thread executes not only its own callback but also the pending
+ * callbacks of other threads. Under sustained load this can take a long time.
+ * Once either limit is reached, the submitter returns and leaves the remaining
+ * callbacks to other submitters, aru_sync() or aru_wait().
+ *
+ * The budget applies to aru_update(), aru_read() and the other asynchronous
+ * submission APIs. aru_sync(), aru_wait() and the synchronous submission APIs
+ * are not bounded, nor is the leader of a lane, see aru_set_lanes(). Should be
+ * set before the aru is shared between threads.
+ */
+void aru_set_help_budget(struct aru *aru, uint32_t max_nodes, int64_t max_ns);
+
+/*
+ * aru_set_enqueue_only - Make submitters only publish their nodes
+ * @aru: pointer of the aru
+ * @enqueue_only: true to stop submitters from executing callbacks
+ *
+ * By default, a thread submitting a node also executes pending callbacks,
+ * including the ones submitted by other threads. In enqueue-only mode, the
+ * submission APIs only insert the node and return. The synchronous APIs and
+ * aru_wait() park instead of helping.
+ *
+ * Callbacks are then executed only by the drainer threads started with
+ * aru_start_drainers() and by explicit aru_sync() calls. Should be set before
+ * the aru is shared between threads.
+ */
+void aru_set_enqueue_only(struct aru *aru, bool enqueue_only);
+
+/*
+ * aru_start_drainers - Start threads dedicated to executing the aru's nodes
+ * @aru: pointer of the aru
+ * @nthreads: number of drainer threads
+ *
+ * The drainers execute pending callbacks and sleep while the aru is idle. They
+ * run until aru_destroy() is called. Can be called only once per aru.
+ *
+ * Returns true on success, false on failure.
+ */
+bool aru_start_drainers(struct aru *aru, int nthreads);
+
+/*
+ * aru_executor_init - Create a thread pool serving many arus
+ * @nthreads: number of worker threads
+ *
+ * Instead of dedicating drainers to each aru, many arus can share one pool of
+ * workers. An aru with pending nodes is put in a ready queue once, and a worker
+ * drains it like aru_sync(). Idle workers steal arus from the queues of busy
+ * ones and sleep when there is no work at all.
+ *
+ * Returns pointer to an aru_executor, or NULL on failure.
+ */
+struct aru_executor *aru_executor_init(int nthreads);
+
+/*
+ * aru_executor_destroy - Stop the workers and destroy the executor
+ * @executor: pointer of the aru_executor
+ *
+ * Every aru attached to the executor must be destroyed before this.
+ */
+void aru_executor_destroy(struct aru_executor *executor);
+
+/*
+ * aru_set_executor - Let a shared executor execute the aru's nodes
+ * @aru: pointer of the aru
+ * @executor: pointer of the aru_executor
+ *
+ * Puts the aru in enqueue-only mode, see aru_set_enqueue_only(). Should be set
+ * before the aru is shared between threads.
+ */
+void aru_set_executor(struct aru *aru, struct aru_executor *executor);
+
+/*
+ * aru_set_reclaim_granularity - Move the tail only in steps of several nodes
+ * @aru: pointer of the aru
+ * @nodes: minimum number of completed nodes per tail movement, at least 1
+ *
+ * Moving the tail creates a new tail version and later reclaims the nodes it
+ * covered. With a larger granularity this cost is shared by more callbacks,
+ * while completed nodes are kept alive a little longer and traversals start
+ * further behind. The default is 1.
+ *
+ * Should be set before the aru is shared between threads.
+ */
+void aru_set_reclaim_granularity(struct aru *aru, uint64_t nodes);
+
+/*
+ * aru_set_deferred_reclaim - Leave retired node ranges to aru_reclaim()
+ * @aru: pointer of the aru
+ * @deferred: true to defer, false to free them where they retire
+ *
+ * By default, the thread releasing the last reference to an old tail frees
+ * the whole node range on the spot, which can put a long free() loop into a
+ * submitter's latency. When deferred, the range is pushed into a lock-free
+ * list instead, and freed by aru_reclaim() or by the reclaimer thread.
+ *
+ * Should be set before the aru is shared between threads.
+ */
+void aru_set_deferred_reclaim(struct aru *aru, bool deferred);
+
+/*
+ * aru_reclaim - Free the node ranges retired so far
+ * @aru: pointer of the aru
+ *
+ * Can be called from any thread at any time. Returns the number of freed
+ * nodes.
+ */
+size_t aru_reclaim(struct aru *aru);
+
+/*
+ * aru_start_reclaimer - Start a thread freeing the retired node ranges
+ * @aru: pointer of the aru
+ *
+ * Turns on deferred reclamation and frees the retired ranges in the background.
+ * The thread sleeps while nothing is retired and runs until the aru is
+ * destroyed. Can be called only once per aru. Returns true on success, false
+ * on failure.
+ */
+bool aru_start_reclaimer(struct aru *aru);
+
+/*
+ * aru_set_fast_path - Enable or disable inline execution on an idle aru
+ * @aru: pointer of the aru
+ * @enabled: whether callers may run their callback inline
+ *
+ * When every submitted node is done and no other caller is on the fast path,
+ * aru_update() and its variants run the update directly in the calling
+ * thread, without allocating or inserting a node. Under contention they fall
+ * back to the queue. The tag, if given, is ARU_TAG_DONE on return in that
+ * case. Reads always go through the queue, so they still run concurrently.
+ *
+ * Enabled by default. Not used in enqueue-only mode. Should be set before the
+ * aru is shared between threads.
+ */
+void aru_set_fast_path(struct aru *aru, bool enabled);
+
+/*
+ * aru_update_keyed - Update API whose pending updates coalesce per key
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @key: updates with the same key supersede each other
+ * @update: user's update function
+ * @args: update function's arguments
+ *
+ * Same as aru_update(), but meant for updates that overwrite the whole state
+ * they touch, like a full snapshot of one book. Once a newer keyed update with
+ * the same key is queued behind a keyed update that has not started yet, the
+ * older one is skipped: its tag becomes ARU_TAG_DONE | ARU_TAG_SKIPPED and its
+ * callback never runs. Reads queued between the two see the state without the
+ * skipped update.
+ *
+ * Keys are tracked in a small hash table. When keys collide, an update may not
+ * be skipped although it could have been, but never the other way around.
+ */
+void aru_update_keyed(struct aru *aru, aru_tag *tag, uint64_t key,
+	void (*update)(void *args), void *args);
+
+/*
+ * aru_read_shared - Read API for idempotent reads that may be served together
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @read: user's read function
+ * @args: read function's arguments
+ *
+ * Same as aru_read(), but for reads whose effect does not depend on how many
+ * times they run. When several shared reads with the same @read and @args are
+ * pending with no update between them, the callback runs once and the tags of
+ * all of them become ARU_TAG_DONE.
+ */
+void aru_read_shared(struct aru *aru, aru_tag *tag,
+	void (*read)(void *args), void *args);
+
+/*
+ * aru_enable_snapshots - Publish an immutable snapshot after updates
+ * @aru: pointer of the aru
+ * @clone: user's hook returning an immutable copy of the state
+ * @release: user's hook freeing a snapshot returned by @clone
+ * @ctx: argument passed to both hooks
+ *
+ * Updates keep going through the queue as before. Once an update callback
+ * returns, and no other update is queued right behind it, @clone runs with the
+ * same exclusivity as the update and its result becomes the latest snapshot.
+ * A burst of updates thus publishes once at its end. Replaced snapshots are
+ * passed to @release when their last reader is done.
+ *
+ * The first snapshot is published by this function. Should be called before
+ * the aru is shared between threads. Returns true on success, false on
+ * failure.
+ */
+bool aru_enable_snapshots(struct aru *aru, void *(*clone)(void *ctx),
+	void (*release)(void *snapshot, void *ctx), void *ctx);
+
+/*
+ * aru_read_snapshot - Run a read against the latest snapshot
+ * @aru: pointer of the aru
+ * @read: user's read function, called with the snapshot and @args
+ * @args: read function's arguments
+ *
+ * The read runs immediately in the calling thread, without a node, and never
+ * waits for pending updates nor holds them back. It sees the state as of the
+ * latest published snapshot, which may not include updates still in flight.
+ *
+ * Returns false if snapshots are not enabled, true otherwise.
+ */
+bool aru_read_snapshot(struct aru *aru,
+	void (*read)(void *snapshot, void *args), void *args);
+
+/*
+ * aru_read_optimistic - Read API running the callback without a node
+ * @aru: pointer of the aru
+ * @read: user's read function
+ * @args: read function's arguments
+ *
+ * aru counts the update callbacks it starts and finishes. This function runs
+ * @read directly in the calling thread while no update is in progress, and
+ * accepts the result only if no update started meanwhile. Otherwise it retries
+ * a few times and then falls back to aru_read_sync(), so the read has completed
+ * on return either way.
+ *
+ * @read may thus run against a state an update is modifying, and run more than
+ * once. It must only copy data into @args, must not follow pointers that an
+ * update may free, and must not have side effects. Updates submitted but not
+ * executed yet are not visible, even the caller's own.
+ *
+ * Returns true if the read was validated without the queue, false if it went
+ * through the queue.
+ */
+bool aru_read_optimistic(struct aru *aru, void (*read)(void *args), void *args);
+
+/*
+ * aru_update2 - Split-phase update API
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @prepare: user's function run before ordering, may be NULL
+ * @commit: user's update function
+ * @args: arguments of both functions
+ *
+ * Many updates spend most of their time on work that does not touch the shared
+ * state, like parsing a message. @prepare does that work in the calling thread
+ * before the update is queued, concurrently with other threads, and leaves its
+ * result in @args. @commit then runs exclusively in queue order like an
+ * aru_update() callback, and only has to apply the prepared result.
+ *
+ * The update is ordered when @commit is queued, after @prepare returns.
+ */
+void aru_update2(struct aru *aru, aru_tag *tag, void (*prepare)(void *args),
+	void (*commit)(void *args), void *args);
+
+/*
+ * aru_set_batch_hooks - Register hooks around each run of callbacks
+ * @aru: pointer of the aru
+ * @begin_batch: called before the first callback of a run, may be NULL
+ * @end_batch: called after the last callback of a run, may be NULL
+ * @ctx: argument passed to both hooks
+ *
+ * A thread traversing the aru executes a run of consecutive callbacks, its
+ * batch. @begin_batch is called in that thread right before the first of them
+ * and @end_batch right after the last, so per-update work like flushing a log
+ * buffer or sending a notification can be done once per batch. A callback run
+ * inline by the fast path is a batch of its own.
+ *
+ * The tags of a batch become ARU_TAG_DONE only after @end_batch has returned,
+ * so a thread waiting on a tag, for example in aru_wait() or
+ * aru_update_sync(), sees the work of @end_batch done as well. A batch ends
+ * early once it holds back 32 tags.
+ *
+ * Several threads may run batches at the same time, for example of reads, so
+ * the hooks themselves do not run exclusively. Should be set before the aru is
+ * shared between threads.
+ */
+void aru_set_batch_hooks(struct aru *aru, void (*begin_batch)(void *ctx),
+	void (*end_batch)(void *ctx), void *ctx);
+
+/*
+ * aru_update_masked - Update API that only conflicts with overlapping updates
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @mask: conflict domains touched by the update, one bit per domain
+ * @update: user's update function
+ * @args: update function's arguments
+ *
+ * The user splits the aru's state into up to 16 conflict domains, like the bid
+ * and ask sides of a book, and declares which of them the update touches. The
+ * update then waits only for earlier reads and earlier updates whose domains
+ * overlap, so updates of disjoint domains run at the same time on different
+ * threads. Order is kept within each domain. Reads and the other update APIs
+ * still conflict with everything.
+ *
+ * A @mask of 0 conflicts with everything. With snapshots enabled, @mask is
+ * ignored, since the clone hook needs every update to run exclusively.
+ */
+void aru_update_masked(struct aru *aru, aru_tag *tag, uint16_t mask,
+	void (*update)(void *args), void *args);
+
+/*
+ * aru_sharded_init - Create an aru partitioned by key into shards
+ * @nshards: number of shards
+ *
+ * Each shard is an independent aru with its own queue, so updates of keys in
+ * different shards do not serialize against each other, and neither do their
+ * submitters on a shared head. Order is kept per shard, thus per key.
+ *
+ * Returns pointer to the sharded aru, or NULL on failure.
+ */
+struct aru_sharded *aru_sharded_init(int nshards);
+
+/*
+ * aru_sharded_destroy - Destroy the sharded aru and its shards
+ * @sharded: pointer of the sharded aru
+ */
+void aru_sharded_destroy(struct aru_sharded *sharded);
+
+/*
+ * aru_sharded_shard - Find the shard serving the given key
+ * @sharded: pointer of the sharded aru
+ * @key: user's key
+ *
+ * The shard is a regular aru. It can be passed to aru_wait() for tags of the
+ * key, or used with any other API to submit callbacks of the key.
+ */
+struct aru *aru_sharded_shard(struct aru_sharded *sharded, uint64_t key);
+
+/*
+ * aru_sharded_update - aru_update() on the shard serving the key
+ * @sharded: pointer of the sharded aru
+ * @key: user's key
+ * @tag: status representing progress or result
+ * @update: user's update function
+ * @args: update function's arguments
+ */
+void aru_sharded_update(struct aru_sharded *sharded, uint64_t key,
+	aru_tag *tag, void (*update)(void *args), void *args);
+
+/*
+ * aru_sharded_read - aru_read() on the shard serving the key
+ * @sharded: pointer of the sharded aru
+ * @key: user's key
+ * @tag: status representing progress or result
+ * @read: user's read function
+ * @args: read function's arguments
+ */
+void aru_sharded_read(struct aru_sharded *sharded, uint64_t key,
+	aru_tag *tag, void (*read)(void *args), void *args);
+
+/*
+ * aru_sharded_read_all - Run one read against all shards at once
+ * @sharded: pointer of the sharded aru
+ * @read: user's read function
+ * @args: read function's arguments
+ *
+ * The read runs after every update submitted to any shard before this call,
+ * and no update submitted afterwards runs at the same time, so it sees a
+ * consistent cut of all shards. While it runs, every shard is held, so keep it
+ * short. Returns after the read has run.
+ */
+void aru_sharded_read_all(struct aru_sharded *sharded,
+	void (*read)(void *args), void *args);
+
+/*
+ * aru_replicated_init - Create an object replicated per NUMA node
+ * @nreplicas: number of replicas, 0 or less for one per NUMA node
+ * @factory: user's hook returning the initial replica for the given node
+ * @destroy: user's hook freeing a replica, may be NULL
+ * @ctx: argument of both hooks
+ *
+ * Each NUMA node reads its own copy of the object, so reads never cross
+ * sockets. Updates are ordered by an internal aru into an operation log, and
+ * every replica applies the log lazily before serving its local reads.
+ *
+ * @factory is called once per replica with the node id, and should allocate
+ * the replica on that node, for example with numa_alloc_onnode(). The online
+ * nodes are taken from sysfs, and only those are passed, even if their ids
+ * have holes. With more replicas than online nodes, the nodes are reused in
+ * turn.
+ *
+ * Returns pointer to the replicated object, or NULL on failure.
+ */
+struct aru_replicated *aru_replicated_init(int nreplicas,
+	void *(*factory)(int node, void *ctx),
+	void (*destroy)(void *replica, void *ctx), void *ctx);
+
+/*
+ * aru_replicated_destroy - Destroy the replicated object and its replicas
+ * @replicated: pointer of the replicated object
+ */
+void aru_replicated_destroy(struct aru_replicated *replicated);
+
+/*
+ * aru_replicated_update - Log an update to be applied to every replica
+ * @replicated: pointer of the replicated object
+ * @tag: status representing progress or result
+ * @update: user's update function, called with a replica and @args
+ * @args: update function's arguments
+ *
+ * The tag becomes ARU_TAG_DONE once the update is in the log, so every read
+ * starting afterwards on any node sees it. @update runs once per replica, each
+ * time exclusively on that replica, and must have the same effect on each.
+ *
+ * @args is used until every replica has applied the update, which is certain
+ * after aru_replicated_sync() or after 4096 newer updates have been logged.
+ */
+void aru_replicated_update(struct aru_replicated *replicated, aru_tag *tag,
+	void (*update)(void *replica, void *args), void *args);
+
+/*
+ * aru_replicated_read - Read the replica of the caller's NUMA node
+ * @replicated: pointer of the replicated object
+ * @read: user's read function, called with the replica and @args
+ * @args: read function's arguments
+ *
+ * The local replica first applies the updates logged so far. The read then runs
+ * in the calling thread, concurrently with other reads of the same replica.
+ */
+void aru_replicated_read(struct aru_replicated *replicated,
+	void (*read)(void *replica, void *args), void *args);
+
+/*
+ * aru_replicated_sync - Apply every logged update to every replica
+ * @replicated: pointer of the replicated object
+ */
+void aru_replicated_sync(struct aru_replicated *replicated);
+
+/*
+ * aru_set_commands - Register the command table of the aru
+ * @aru: pointer of the aru
+ * @commands: command table, indexed by opcode, must outlive the aru
+ * @count: number of @commands
+ * @ctx: argument passed to every handler, like the state the aru protects
+ *
+ * Should be set before the aru is shared between threads.
+ */
+void aru_set_commands(struct aru *aru, const struct aru_command *commands,
+	uint32_t count, void *ctx);
+
+/*
+ * aru_submit_cmd - Submit a command with its payload copied into the node
+ * @aru: pointer of the aru
+ * @tag: status representing progress or result
+ * @opcode: index of the command in the aru's command table
+ * @payload: payload passed to the command's handler
+ * @len: length of @payload, at most ARU_CMD_PAYLOAD_MAX
+ *
+ * Instead of a callback with arguments the user has to allocate and free, the
+ * command is an opcode and a payload. The payload is copied into the node, so
+ * the caller may reuse it right away, and the handler finds it next to the node
+ * instead of behind another pointer. The handler must not keep the payload
+ * pointer after it returns.
+ *
+ * Returns true on success, false if the opcode, its type or the length is
+ * invalid, or the node cannot be allocated.
+ */
+bool aru_submit_cmd(struct aru *aru, aru_tag *tag, uint32_t opcode,
+	const void *payload, size_t len);
+
+/*
+ * aru_set_lanes - Submit through per-NUMA-node lanes
+ * @aru: pointer of the aru
+ * @nlanes: number of lanes, 0 or less for one per NUMA node
+ *
+ * By default every submitter exchanges the aru's single head, which bounces
+ * across sockets. With lanes, a submitter pushes its node into the lane of its
+ * NUMA node instead. One submitter at a time leads the lane: it splices all
+ * nodes pending in the lane into the list with a single head exchange and
+ * executes them, while the others return right away. Each thread stays on
+ * the lane it first used, so its own nodes keep their order.
+ *
+ * Only this per-thread order is kept. A node gets its place in the list when
+ * its lane is spliced, not when it is submitted, so it may be ordered after a
+ * node that another thread submitted later through another lane. Even when
+ * aru_update() has returned, its update is not yet ordered against the other
+ * threads' submissions. Use aru_update_sync() where that order matters, it
+ * returns only after the update is applied.
+ *
+ * The leader executes the nodes it spliced regardless of the helping budget,
+ * since their submitters do not help anymore.
+ *
+ * The inline fast path is not used with lanes. Should be set before the aru is
+ * shared between threads. Returns true on success, false on failure.
+ */
+bool aru_set_lanes(struct aru *aru, int nlanes);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
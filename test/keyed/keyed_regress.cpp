@@ -0,0 +1,122 @@
+// Regression test for keyed updates superseding each other.
+//
+// Each thread owns a few keys and submits keyed updates with increasing values
+// for them, mixed with plain updates so that other threads keep traversing the
+// list while keyed nodes are being linked. Older updates of a key may be
+// skipped, but the newest one must always run. Every round uses a fresh aru,
+// so the first keyed update of each slot is covered as well. The fast path is
+// disabled, since it would run most updates without linking a node.
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+
+#include "../../aru.h"
+
+static const int kKeysPerThread = 4;
+static const int kUpdatesPerKey = 64;
+
+struct KeyedArgs {
+    long* slot;
+    long value;
+};
+
+// Only touched inside aru callbacks
+static std::vector<long> g_state;
+static long g_plain = 0;
+
+static void setCallback(void* args)
+{
+    KeyedArgs* keyed = static_cast<KeyedArgs*>(args);
+    *keyed->slot = keyed->value;
+}
+
+static void plainCallback(void* args)
+{
+    (void)args;
+    g_plain++;
+}
+
+// Returns the number of keys whose newest update was lost
+static int workerFunc(aru* a, int id)
+{
+    std::vector<KeyedArgs> args(kKeysPerThread * kUpdatesPerKey);
+    std::vector<aru_tag> tags(kKeysPerThread * kUpdatesPerKey, ARU_TAG_PENDING);
+    int lost = 0;
+
+    for (int i = 0; i < kUpdatesPerKey; i++) {
+        for (int k = 0; k < kKeysPerThread; k++) {
+            int key = id * kKeysPerThread + k;
+            int n = i * kKeysPerThread + k;
+
+            args[n].slot = &g_state[key];
+            args[n].value = i;
+            aru_update_keyed(a, &tags[n], key, setCallback, &args[n]);
+            aru_update(a, nullptr, plainCallback, nullptr);
+        }
+    }
+
+    for (auto& tag : tags) {
+        aru_wait(a, &tag, -1);
+    }
+
+    for (int k = 0; k < kKeysPerThread; k++) {
+        int n = (kUpdatesPerKey - 1) * kKeysPerThread + k;
+        if (tags[n] & ARU_TAG_SKIPPED) {
+            lost++;
+        }
+    }
+
+    return lost;
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = argc > 1 ? std::atoi(argv[1]) : 4;
+    int rounds  = argc > 2 ? std::atoi(argv[2]) : 2000;
+    int lost = 0, wrong = 0;
+
+    if (threads <= 0 || rounds <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [threads] [rounds]\n";
+        return 1;
+    }
+
+    for (int r = 0; r < rounds; r++) {
+        aru* a = aru_init();
+        if (!a) {
+            std::cerr << "aru_init() failed\n";
+            return 1;
+        }
+        aru_set_fast_path(a, false);
+
+        g_state.assign(threads * kKeysPerThread, -1);
+
+        std::vector<std::thread> workers;
+        std::vector<int> results(threads);
+        for (int i = 0; i < threads; i++) {
+            workers.emplace_back([a, i, &results] {
+                results[i] = workerFunc(a, i);
+            });
+        }
+
+        for (int i = 0; i < threads; i++) {
+            workers[i].join();
+            lost += results[i];
+        }
+
+        aru_sync(a);
+        for (long value : g_state) {
+            if (value != kUpdatesPerKey - 1) {
+                wrong++;
+            }
+        }
+
+        aru_destroy(a);
+    }
+
+    std::cout << "Rounds:       " << rounds << "\n"
+              << "Lost newest:  " << lost << "\n"
+              << "Wrong state:  " << wrong << "\n";
+
+    return (lost == 0 && wrong == 0) ? 0 : 1;
+}
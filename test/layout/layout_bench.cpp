@@ -0,0 +1,108 @@
+// Contention benchmark for the struct aru / struct aru_node layout.
+//
+// All threads hammer a single aru with tiny updates and reads, so the cost is
+// dominated by cache line traffic on the aru and its nodes rather than by the
+// callbacks themselves. Build it twice, once against the compact layout and
+// once against ARU_CACHELINE_LAYOUT, and compare the throughput at 16 or more
+// threads.
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+
+#include "../../aru.h"
+
+static aru* g_aru;
+static std::atomic<bool> g_running(true);
+
+// Only touched inside aru callbacks
+static long g_value = 0;
+static long g_sum = 0;
+
+static void updateCallback(void* args)
+{
+    g_value += reinterpret_cast<intptr_t>(args);
+}
+
+static void readCallback(void* args)
+{
+    (void)args;
+    g_sum += g_value;
+}
+
+static void workerFunc(int readEvery, std::atomic<long>* ops)
+{
+    long count = 0;
+
+    while (g_running.load(std::memory_order_relaxed)) {
+        if (readEvery > 0 && count % readEvery == 0) {
+            aru_read(g_aru, nullptr, readCallback, nullptr);
+        } else {
+            aru_update(g_aru, nullptr, updateCallback,
+                reinterpret_cast<void*>(static_cast<intptr_t>(1)));
+        }
+        count++;
+    }
+
+    ops->fetch_add(count, std::memory_order_relaxed);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <threads> <runSeconds> [readEvery]\n";
+        return 1;
+    }
+
+    int threads      = std::atoi(argv[1]);
+    double runSeconds = std::atof(argv[2]);
+    int readEvery    = argc > 3 ? std::atoi(argv[3]) : 4;
+
+    if (threads <= 0 || runSeconds <= 0.0 || readEvery < 0) {
+        std::cerr << "Invalid args\n";
+        return 1;
+    }
+
+    g_aru = aru_init();
+    if (!g_aru) {
+        std::cerr << "aru_init() failed\n";
+        return 1;
+    }
+
+    std::atomic<long> ops(0);
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+
+    auto startTime = std::chrono::steady_clock::now();
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(workerFunc, readEvery, &ops);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds((int)(runSeconds * 1000)));
+    g_running.store(false, std::memory_order_relaxed);
+
+    for (auto &th : workers) {
+        th.join();
+    }
+    auto endTime = std::chrono::steady_clock::now();
+
+    aru_sync(g_aru);
+
+    double elapsedSec = std::chrono::duration<double>(endTime - startTime).count();
+#ifdef ARU_CACHELINE_LAYOUT
+    std::cout << "Layout:           padded\n";
+#else
+    std::cout << "Layout:           compact\n";
+#endif
+    std::cout << "Threads:          " << threads << "\n";
+    std::cout << "Submissions:      " << ops.load() << "\n";
+    std::cout << "Elapsed time:     " << elapsedSec << " sec\n";
+    std::cout << "Throughput:       " << ops.load() / elapsedSec << " ops/sec\n";
+
+    aru_destroy(g_aru);
+
+    return 0;
+}
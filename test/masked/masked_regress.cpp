@@ -0,0 +1,74 @@
+// Regression test for masked updates queued behind overlapping reads.
+//
+// Two slow reads run at the same time on different threads, and a masked
+// update is queued behind both. Each reader passes the other's read while it
+// is still running, and the masked update must not be left behind by both:
+// once every submitter has returned, its tag has to be done without any
+// aru_sync(). The fast path is disabled so that every request is queued.
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+
+#include "../../aru.h"
+
+using namespace std::chrono_literals;
+
+// Only touched inside aru callbacks
+static long g_value = 0;
+
+static void slowRead(void* args)
+{
+    std::this_thread::sleep_for(*static_cast<std::chrono::milliseconds*>(args));
+}
+
+static void maskedUpdate(void* args)
+{
+    (void)args;
+    g_value++;
+}
+
+int main(int argc, char* argv[])
+{
+    int rounds = argc > 1 ? std::atoi(argv[1]) : 20;
+    int stranded = 0;
+
+    if (rounds <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [rounds]\n";
+        return 1;
+    }
+
+    for (int r = 0; r < rounds; r++) {
+        aru* a = aru_init();
+        if (!a) {
+            std::cerr << "aru_init() failed\n";
+            return 1;
+        }
+        aru_set_fast_path(a, false);
+
+        std::chrono::milliseconds first(10), second(20);
+        aru_tag t1, t2, tm;
+
+        std::thread r1([&] { aru_read(a, &t1, slowRead, &first); });
+        std::this_thread::sleep_for(2ms);
+        std::thread r2([&] { aru_read(a, &t2, slowRead, &second); });
+        std::this_thread::sleep_for(4ms);
+
+        aru_update_masked(a, &tm, 0x1, maskedUpdate, nullptr);
+
+        r1.join();
+        r2.join();
+
+        if (!ARU_TAG_IS_DONE(tm)) {
+            stranded++;
+        }
+
+        aru_sync(a);
+        aru_destroy(a);
+    }
+
+    std::cout << "Rounds:       " << rounds << "\n"
+              << "Stranded:     " << stranded << "\n";
+
+    return stranded == 0 ? 0 : 1;
+}
@@ -224,18 +224,9 @@ void readThreadFunc_allBooks()
         }
 
 #if 0
-        // 2) 태그가 모두 DONE인지 polling
-        bool allDone = false;
-        while (!allDone && g_running.load(std::memory_order_relaxed)) {
-            allDone = true;
-            for (int i = 0; i < g_numBooks; i++) {
-                if (tags[i] != ARU_TAG_DONE) {
-					aru_sync(g_books[i].book_aru);
-                    allDone = false;
-                    continue;
-                }
-            }
-            // 1ms sleep 제거 -> 바로 재확인 가능
+        // 2) 태그가 모두 DONE이 될 때까지 대기 (spin 후 futex로 park)
+        for (int i = 0; i < g_numBooks; i++) {
+            aru_wait(g_books[i].book_aru, &tags[i], -1);
         }
 #endif
     }